@@ -27,6 +27,47 @@
 #include <ZL_Math3D.h>
 
 #include <vector>
+#include <algorithm>
+#include <atomic>
+#include <thread>
+#include <time.h>
+#include <stdarg.h>
+#include <signal.h>
+#include <math.h>
+#include <chrono>
+#include <new>
+#if defined(_MSC_VER)
+#include <intrin.h>
+#endif
+#if defined(_MSC_VER) || defined(__MINGW32__) || defined(__WIN32__) || defined(WIN32) || defined(_WIN32)
+#ifndef NOMINMAX
+#define NOMINMAX
+#endif
+#include <windows.h>
+#include <psapi.h>
+#include <io.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#else
+#include <sys/resource.h>
+#include <fcntl.h>
+#include <unistd.h>
+#endif
+#if defined(__APPLE__)
+#include <malloc/malloc.h>
+#elif !defined(_MSC_VER) && !defined(__MINGW32__) && !defined(__WIN32__) && !defined(WIN32) && !defined(_WIN32)
+#include <malloc.h>
+#endif
+#if defined(__linux__)
+#include <linux/perf_event.h>
+#include <sys/syscall.h>
+#include <sys/mman.h>
+#include <unistd.h>
+#include <elf.h>
+#include <errno.h>
+#include <cxxabi.h>
+#include <map>
+#endif
 
 #include <libretro-common/include/libretro.h>
 #include <include/cross.h>
@@ -41,9 +82,13 @@ enum EHotkeyFKeys
 	HOTKEY_F_PAUSE       =  1,
 	HOTKEY_F_SLOWMOTION  =  2,
 	HOTKEY_F_FASTFORWARD =  3,
+	HOTKEY_F_TRACE       =  4,
 	HOTKEY_F_QUICKSAVE   =  5,
+	HOTKEY_F_SCREENSHOT  =  6,
 	HOTKEY_F_FULLSCREEN  =  7,
+	HOTKEY_F_CAPTURE     =  8,
 	HOTKEY_F_QUICKLOAD   =  9,
+	HOTKEY_F_PROFILER    = 10,
 	HOTKEY_F_LOCKMOUSE   = 11,
 	HOTKEY_F_TOGGLEOSD   = 12,
 };
@@ -51,6 +96,8 @@ static unsigned short HotkeyMod;
 static unsigned char ThrottleMode, LastAudioThrottleMode;
 static bool ThrottlePaused, SpeedModHold, DisableSystemALT, UseMiddleMouseMenu, PointerLock, DrawStretched;
 static bool DrawCoreShader, DoApplyInterfaceOptions, DoApplyGeometry, DoSave, DoLoad, AudioSkip, DefaultPointerLock;
+static bool Headless, Unthrottled, ReadOnlySettings; // command line options
+static unsigned RunFrameLimit, RunFrameCount;
 static char Scaling;
 static int CRTFilter, AudioLatency;
 static float FastRate = 5.0f, SlowRate = 0.3f;
@@ -352,24 +399,583 @@ static const retro_key ZLKtoRETROKEY[] =
 	RETROK_UNKNOWN, //ZLK_LAST
 };
 static bool RETROKDown[RETROK_LAST];
+// Fixed size lock-free queue for exactly one producer thread and one consumer thread
+template <typename T, unsigned N> struct SSPSCQueue
+{
+	T items[N];
+	std::atomic<unsigned> head, tail;
+	bool Push(const T& v)
+	{
+		const unsigned h = head.load(std::memory_order_relaxed);
+		if (h - tail.load(std::memory_order_acquire) == N) return false;
+		items[h % N] = v;
+		head.store(h + 1, std::memory_order_release);
+		return true;
+	}
+	bool Pop(T& v)
+	{
+		const unsigned t = tail.load(std::memory_order_relaxed);
+		if (t == head.load(std::memory_order_acquire)) return false;
+		v = items[t % N];
+		tail.store(t + 1, std::memory_order_release);
+		return true;
+	}
+	unsigned PushMany(const T* v, unsigned n)
+	{
+		const unsigned h = head.load(std::memory_order_relaxed), fit = N - (h - tail.load(std::memory_order_acquire));
+		if (n > fit) n = fit;
+		for (unsigned i = 0; i != n; i++) items[(h + i) % N] = v[i];
+		head.store(h + n, std::memory_order_release);
+		return n;
+	}
+	unsigned PopMany(T* v, unsigned n)
+	{
+		const unsigned t = tail.load(std::memory_order_relaxed), have = head.load(std::memory_order_acquire) - t;
+		if (n > have) n = have;
+		for (unsigned i = 0; i != n; i++) v[i] = items[(t + i) % N];
+		tail.store(t + n, std::memory_order_release);
+		return n;
+	}
+	unsigned Count() const { return head.load(std::memory_order_acquire) - tail.load(std::memory_order_acquire); }
+};
+
 static retro_system_av_info av { { 1024, 1024, 1024, 1024, 1 }, { 70.0f, 44100.0f } };
 static retro_keyboard_event_t retro_keyboard_event_cb;
 static scalar ui_last_audio_stretch = 1.0f;
 static ZL_Rectf core_rec, osd_rec;
 static ZL_TextBuffer txtOSD;
-static ticks_t txtOSDTick, dirtySettingsTick;
+static ticks_t txtOSDTick;
 struct SNotify { ZL_TextBuffer txt; unsigned duration; retro_log_level level; ticks_t ticks; float y; };
 static std::vector<SNotify> vecNotify;
+static std::vector<ZL_TextBuffer> vecNotifySpare; // text buffers of expired notifications reused by PushNotify
+
+// Always-on flight recorder keeping the last few thousand frames for diagnosing freezes and crashes after long sessions
+// Written to flight_recorder.txt in the saves directory on a crash, on SIGUSR1 and on exit
+static struct SFlightRecorder
+{
+	enum { FRAMES = 4096, NOTES = 32, NOTE_LEN = 96, FLAG_SAVE = 1, FLAG_LOAD = 2, FLAG_PAUSED = 4, FLAG_NOTIFY = 8 };
+	struct SFrame { Bit32u frame, tick, frameUsec, runUsec; Bit16u audioFill; Bit8u throttle, flags; };
+	struct SNote { Bit32u frame; Bit8u level; char text[NOTE_LEN]; };
+	SFrame frames[FRAMES];
+	SNote notes[NOTES];
+	Bit32u frameCount, noteCount, runUsec;
+	retro_time_t lastFrame;
+	char path[1024];
+	#if defined(_MSC_VER) || defined(__MINGW32__) || defined(__WIN32__) || defined(WIN32) || defined(_WIN32)
+	wchar_t wpath[1024]; // converted up front so the crash handler can open the file without allocating
+	#endif
+	volatile sig_atomic_t dumpRequested;
+
+	// Formats into a fixed buffer without stdio or heap so the dump can be written from the crash signal handler
+	struct SWriter
+	{
+		FILE* f; int fd; size_t len; char buf[4096];
+		void Flush()
+		{
+			if (f) fwrite(buf, 1, len, f);
+			#if defined(_MSC_VER) || defined(__MINGW32__) || defined(__WIN32__) || defined(WIN32) || defined(_WIN32)
+			else if (_write(fd, buf, (unsigned)len) < 0) {}
+			#else
+			else if (write(fd, buf, len) < 0) {}
+			#endif
+			len = 0;
+		}
+		SWriter& Str(const char* str, size_t pad = 0)
+		{
+			size_t n = strlen(str);
+			for (; n < pad; pad--) Chr(' ');
+			for (; *str; str++) Chr(*str);
+			return *this;
+		}
+		SWriter& Num(Bit32u val, size_t pad = 0)
+		{
+			char tmp[11], *p = tmp + sizeof(tmp);
+			*--p = '\0';
+			do { *--p = (char)('0' + val % 10); val /= 10; } while (val);
+			return Str(p, pad);
+		}
+		SWriter& Chr(char c) { if (len == sizeof(buf)) Flush(); buf[len++] = c; return *this; }
+	};
+
+	void Install()
+	{
+		snprintf(path, sizeof(path), "%s/flight_recorder.txt", PathSaves.c_str());
+		#if defined(_MSC_VER) || defined(__MINGW32__) || defined(__WIN32__) || defined(WIN32) || defined(_WIN32)
+		if (!MultiByteToWideChar(CP_UTF8, 0, path, -1, wpath, (int)COUNT_OF(wpath))) wpath[0] = L'\0';
+		#endif
+		signal(SIGSEGV, OnSignal);
+		signal(SIGABRT, OnSignal);
+		#ifdef SIGUSR1
+		signal(SIGUSR1, OnSignal);
+		#endif
+	}
+
+	static void OnSignal(int sig);
+
+	void Note(retro_log_level level, const char* text)
+	{
+		SNote& n = notes[noteCount++ % NOTES];
+		n.frame = frameCount;
+		n.level = (Bit8u)level;
+		strncpy(n.text, text, NOTE_LEN - 1);
+		n.text[NOTE_LEN - 1] = '\0';
+	}
+
+	void Frame(retro_time_t now, bool doSave, bool doLoad, bool paused)
+	{
+		extern Bit32u DBP_MIXER_DoneSamplesCount();
+		SFrame& f = frames[frameCount % FRAMES];
+		f.frame = frameCount;
+		f.tick = ZLTICKS;
+		f.frameUsec = (Bit32u)(lastFrame ? now - lastFrame : 0);
+		f.runUsec = runUsec;
+		f.audioFill = (Bit16u)ZL_Math::Min(DBP_MIXER_DoneSamplesCount(), (Bit32u)0xFFFF);
+		f.throttle = ThrottleMode;
+		f.flags = (Bit8u)((doSave ? FLAG_SAVE : 0) | (doLoad ? FLAG_LOAD : 0) | (paused ? FLAG_PAUSED : 0) | (noteCount && notes[(noteCount - 1) % NOTES].frame == frameCount ? FLAG_NOTIFY : 0));
+		lastFrame = now;
+		runUsec = 0;
+		frameCount++;
+		if (dumpRequested) { dumpRequested = 0; Dump("SIGUSR1"); }
+	}
+
+	void Write(SWriter& w, const char* reason)
+	{
+		w.Str("Flight recorder dump (").Str(reason).Str(") at frame ").Num(frameCount).Str(", tick ").Num((Bit32u)ZLTICKS).Str("\n\n");
+		w.Str("Notifications:\n");
+		for (Bit32u i = (noteCount > NOTES ? noteCount - NOTES : 0); i != noteCount; i++)
+			w.Str("  frame ").Num(notes[i % NOTES].frame).Str(" level ").Num(notes[i % NOTES].level).Str(": ").Str(notes[i % NOTES].text).Chr('\n');
+		w.Str("\n   frame      tick  frame_us    run_us  audio  throttle  flags\n");
+		for (Bit32u i = (frameCount > FRAMES ? frameCount - FRAMES : 0); i != frameCount; i++)
+		{
+			const SFrame& r = frames[i % FRAMES];
+			w.Num(r.frame, 8).Chr(' ').Num(r.tick, 9).Chr(' ').Num(r.frameUsec, 9).Chr(' ').Num(r.runUsec, 9).Chr(' ').Num(r.audioFill, 6).Chr(' ').Num(r.throttle, 9).Str("  ");
+			w.Str((r.flags & FLAG_SAVE) ? "S" : "").Str((r.flags & FLAG_LOAD) ? "L" : "").Str((r.flags & FLAG_PAUSED) ? "P" : "").Str((r.flags & FLAG_NOTIFY) ? "N" : "").Chr('\n');
+		}
+		w.Flush();
+	}
+
+	void Dump(const char* reason)
+	{
+		// Called by the main thread on SIGUSR1 and on exit
+		if (!path[0]) return;
+		static SWriter w;
+		if ((w.f = fopen_wrap(path, "wb")) == NULL) return;
+		w.len = 0;
+		Write(w, reason);
+		fclose(w.f);
+	}
+
+	void DumpFromSignal(const char* reason)
+	{
+		// Only async-signal-safe calls here, a crash inside malloc or stdio must not deadlock the dump
+		static SWriter w;
+		w.f = NULL;
+		w.len = 0;
+		#if defined(_MSC_VER) || defined(__MINGW32__) || defined(__WIN32__) || defined(WIN32) || defined(_WIN32)
+		if (!wpath[0] || (w.fd = _wopen(wpath, _O_WRONLY | _O_CREAT | _O_TRUNC | _O_BINARY, _S_IREAD | _S_IWRITE)) < 0) return;
+		Write(w, reason);
+		_close(w.fd);
+		#else
+		if (!path[0] || (w.fd = open(path, O_WRONLY | O_CREAT | O_TRUNC, 0644)) < 0) return;
+		Write(w, reason);
+		close(w.fd);
+		#endif
+	}
+} FlightRecorder;
+
+void SFlightRecorder::OnSignal(int sig)
+{
+	#ifdef SIGUSR1
+	if (sig == SIGUSR1) { FlightRecorder.dumpRequested = 1; return; } // dumped by the main thread at the end of the frame
+	#endif
+	signal(sig, SIG_DFL);
+	FlightRecorder.DumpFromSignal(sig == SIGSEGV ? "SIGSEGV" : "SIGABRT");
+	raise(sig); // default action to still get a core dump
+	_exit(128 + sig);
+}
+
 static std::vector<ZL_JoystickData*> vecJoys;
 
 extern "C" { unsigned int SDL_GetTicks(void); }
+extern "C" { void SDL_JoystickUpdate(void); void SDL_LockJoysticks(void); void SDL_UnlockJoysticks(void); }
 extern "C" { int SDL_ShowCursor(int toggle); }
+extern "C" { void SDL_PumpEvents(void); int SDL_PeepEvents(void* events, int numevents, int action, unsigned minType, unsigned maxType); }
 extern "C" { struct SDL_Window* SDL_GetMouseFocus(void); }
 extern "C" { void* SDL_GL_GetProcAddress(const char *proc); } 
 extern "C" { unsigned long SDL_GetThreadID(struct SDL_Thread* = NULL); }
-#if defined(ZILLALOG)
 static unsigned long MainThreadID = SDL_GetThreadID();
-#endif
+
+// Messages, notifications and geometry/AV info changes sent from threads other than the main thread (i.e. core worker threads)
+// Bounded lock-free multi-producer single-consumer ring with a sequence number per slot, drained by the frame loop once per frame
+static struct SThreadEvents
+{
+	enum { QUEUE_SIZE = 64, TEXT_LEN = 256 };
+	enum EType : unsigned char { NOTIFY, STATUS, GEOMETRY, AV_INFO, SHUTDOWN };
+	struct SEvent { EType type; retro_log_level level; unsigned duration; retro_system_av_info av; char text[TEXT_LEN]; };
+	struct SSlot { std::atomic<unsigned> seq; SEvent ev; };
+	SSlot slots[QUEUE_SIZE];
+	std::atomic<unsigned> head, dropped;
+	unsigned tail; // only used by the main thread
+
+	SThreadEvents() : head(0), dropped(0), tail(0) { for (unsigned i = 0; i != QUEUE_SIZE; i++) slots[i].seq.store(i, std::memory_order_relaxed); }
+
+	bool Post(EType type, const char* text = NULL, unsigned duration = 0, retro_log_level level = RETRO_LOG_INFO, const retro_system_av_info* avinfo = NULL)
+	{
+		unsigned pos = head.load(std::memory_order_relaxed);
+		for (SSlot* s;;)
+		{
+			s = &slots[pos % QUEUE_SIZE];
+			const int diff = (int)(s->seq.load(std::memory_order_acquire) - pos);
+			if (diff < 0) { dropped.fetch_add(1, std::memory_order_relaxed); return false; } // main thread is behind, never wait
+			if (diff > 0) { pos = head.load(std::memory_order_relaxed); continue; } // another producer claimed this slot
+			if (!head.compare_exchange_weak(pos, pos + 1, std::memory_order_relaxed)) continue;
+			SEvent& e = s->ev;
+			e.type = type;
+			e.level = level;
+			e.duration = duration;
+			if (avinfo) e.av = *avinfo;
+			if (text) { strncpy(e.text, text, TEXT_LEN - 1); e.text[TEXT_LEN - 1] = '\0'; }
+			s->seq.store(pos + 1, std::memory_order_release);
+			return true;
+		}
+	}
+
+	bool Pending() const { return (slots[tail % QUEUE_SIZE].seq.load(std::memory_order_acquire) == tail + 1); }
+
+	bool Pop(SEvent& out)
+	{
+		SSlot& s = slots[tail % QUEUE_SIZE];
+		if (s.seq.load(std::memory_order_acquire) != tail + 1) return false;
+		out = s.ev;
+		s.seq.store(tail + QUEUE_SIZE, std::memory_order_release);
+		tail++;
+		return true;
+	}
+} ThreadEvents;
+
+static void PushNotify(const char* msg, unsigned duration, retro_log_level level)
+{
+	if (MainThreadID != SDL_GetThreadID()) { ThreadEvents.Post(SThreadEvents::NOTIFY, msg, duration, level); return; }
+	if (vecNotify.capacity() < 16) { vecNotify.reserve(16); vecNotifySpare.reserve(16); }
+	if (vecNotifySpare.empty()) vecNotify.push_back({ ZL_TextBuffer(fntOSD, msg), duration, level, ZLTICKS, 0.0f });
+	else { vecNotify.push_back({ vecNotifySpare.back(), duration, level, ZLTICKS, 0.0f }); vecNotifySpare.pop_back(); vecNotify.back().txt.SetText(msg); }
+	FlightRecorder.Note(level, msg);
+}
+
+
+// Timeline tracing of the frontend and core threads, written as Chrome trace event JSON (loadable in Perfetto or chrome://tracing)
+// Each thread records begin/end events into its own ring buffer, when tracing is off an event costs a single relaxed load
+static struct STrace
+{
+	enum { RING_SIZE = 1 << 16, MARGIN = 1024 }; // events of the ring newer than RING_SIZE - MARGIN can be written while the ring is read
+	struct SEvent { const char* name; long long ns; char ph; unsigned tid; };
+	struct SRing { SEvent events[RING_SIZE]; std::atomic<unsigned> head; std::atomic<bool> exited; unsigned tid; }; // rings of ended threads get reused
+	std::atomic<bool> active;
+	std::vector<SRing*> rings;
+	std::vector<std::pair<unsigned, std::string> > names; // thread names other than the default
+	unsigned threads;
+	ZL_Mutex mtx;
+	long long startNs;
+
+	static long long Now() { return (long long)std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now().time_since_epoch()).count(); }
+
+	SRing* GetRing()
+	{
+		// Same as SLog, the ring is handed back when the thread ends and nothing gets recorded during the rest of its teardown
+		static thread_local SRing* tlsRing;
+		static thread_local bool tlsEnded;
+		static thread_local struct SOwner { ~SOwner() { if (tlsRing) tlsRing->exited.store(true, std::memory_order_release); tlsRing = NULL; tlsEnded = true; } } owner;
+		(void)owner;
+		if (tlsRing || tlsEnded) return tlsRing;
+		mtx.Lock();
+		SRing* r = NULL;
+		for (SRing* it : rings) if (it->exited.load(std::memory_order_acquire)) { r = it; break; }
+		if (!r) { r = new SRing; r->head = 0; rings.push_back(r); }
+		r->exited = false;
+		r->tid = ++threads;
+		if (r->tid == 1) names.push_back(std::make_pair(1u, std::string("Main")));
+		mtx.Unlock();
+		return (tlsRing = r);
+	}
+
+	void Event(const char* name, char ph)
+	{
+		SRing* r = GetRing();
+		if (!r) return;
+		const unsigned h = r->head.load(std::memory_order_relaxed);
+		SEvent& e = r->events[h % RING_SIZE];
+		e.name = name; e.ph = ph; e.ns = Now(); e.tid = r->tid;
+		r->head.store(h + 1, std::memory_order_release);
+	}
+
+	void NameThread(const char* name)
+	{
+		SRing* r = GetRing();
+		if (!r) return;
+		mtx.Lock();
+		std::vector<std::pair<unsigned, std::string> >::iterator it = names.begin();
+		while (it != names.end() && it->first != r->tid) ++it;
+		if (it == names.end()) names.push_back(std::make_pair(r->tid, std::string(name)));
+		else if (it->second != name) it->second = name;
+		mtx.Unlock();
+	}
+
+	void Start()
+	{
+		GetRing(); // make sure the main thread is registered first
+		startNs = Now();
+		active = true;
+	}
+
+	void Stop()
+	{
+		if (!active.exchange(false)) return;
+
+		std::string path = (std::string(PathSaves) += '/').append("trace");
+		retro_vfs_mkdir_impl(path.c_str());
+		const std::string& content_name = DBPS_GetContentName();
+		char stamp[32]; time_t t = time(NULL); strftime(stamp, sizeof(stamp), "_%Y%m%d_%H%M%S.json", localtime(&t));
+		path.append("/").append(content_name.empty() ? "DOSBox-pure" : content_name.c_str()).append(stamp);
+
+		FILE* f = fopen_wrap(path.c_str(), "wb");
+		if (!f) { PushNotify("Error while writing trace", 3000, RETRO_LOG_ERROR); return; }
+		setvbuf(f, NULL, _IOFBF, 1 << 16);
+		fputs("{\"displayTimeUnit\":\"ms\",\"traceEvents\":[\n", f);
+		const char* sep = "";
+		std::vector<SEvent> events;
+		std::vector<std::pair<unsigned, int> > depths; // open scopes per thread
+		mtx.Lock();
+		for (SRing* r : rings)
+		{
+			// Scopes that began before tracing stopped still record their end, so copy the older part of the ring and afterwards
+			// drop what got overwritten while copying
+			const unsigned h = r->head.load(std::memory_order_acquire);
+			const unsigned first = (h > RING_SIZE - MARGIN ? h - (RING_SIZE - MARGIN) : 0);
+			events.clear();
+			for (unsigned i = first; i != h; i++) events.push_back(r->events[i % RING_SIZE]);
+			const unsigned h2 = r->head.load(std::memory_order_acquire);
+			const size_t skip = (h2 - first > RING_SIZE ? (size_t)(h2 - first - RING_SIZE) : 0);
+			for (size_t n = skip; n < events.size(); n++)
+			{
+				const SEvent& e = events[n];
+				if (e.ns < startNs) continue; // left over from an earlier session
+				std::vector<std::pair<unsigned, int> >::iterator d = depths.begin();
+				while (d != depths.end() && d->first != e.tid) ++d;
+				if (d == depths.end()) { depths.push_back(std::make_pair(e.tid, 0)); d = depths.end() - 1; }
+				if (e.ph == 'B') d->second++;
+				else if (!d->second) continue; // the begin of this scope was overwritten when the ring wrapped
+				else d->second--;
+				fprintf(f, "%s{\"name\":\"%s\",\"ph\":\"%c\",\"pid\":1,\"tid\":%u,\"ts\":%.3f}", sep, e.name, e.ph, e.tid, (e.ns - startNs) / 1000.0);
+				sep = ",\n";
+			}
+		}
+		for (const std::pair<unsigned, int>& d : depths)
+		{
+			const char* name = NULL;
+			for (const std::pair<unsigned, std::string>& n : names) if (n.first == d.first) name = n.second.c_str();
+			if (name) fprintf(f, "%s{\"name\":\"thread_name\",\"ph\":\"M\",\"pid\":1,\"tid\":%u,\"args\":{\"name\":\"%s\"}}", sep, d.first, name);
+			else fprintf(f, "%s{\"name\":\"thread_name\",\"ph\":\"M\",\"pid\":1,\"tid\":%u,\"args\":{\"name\":\"Thread %u\"}}", sep, d.first, d.first);
+			sep = ",\n";
+		}
+		mtx.Unlock();
+		fputs("\n]}\n", f);
+		fclose(f);
+		PushNotify(ZL_String::format("Saved trace to %s", path.c_str()).c_str(), 3000, RETRO_LOG_INFO);
+	}
+} Trace;
+
+struct STraceScope
+{
+	const char* name;
+	STraceScope(const char* n) : name(Trace.active.load(std::memory_order_relaxed) ? n : NULL) { if (name) Trace.Event(name, 'B'); }
+	~STraceScope() { if (name) Trace.Event(name, 'E'); }
+};
+#define TRACE_SCOPE(name) STraceScope trace_scope(name)
+
+// Log backend for the core's retro_log_callback and the frontend, safe to call from any thread without blocking
+// Messages are formatted into a ring buffer of the calling thread and written to a rotating log file by a background thread
+static struct SLog
+{
+	enum { RING_SIZE = 256, TEXT_LEN = 256, MAX_FILE_SIZE = 4 << 20, BACKUPS = 2, MAX_LINES_PER_SEC = 100 };
+	struct SEntry { long long ns; retro_log_level level; char text[TEXT_LEN]; };
+	struct SRing
+	{
+		SEntry entries[RING_SIZE];
+		std::atomic<unsigned> head, tail, dropped;
+		std::atomic<bool> exited; // owning thread ended, freed by the writer thread once drained
+		unsigned idx, repeats, lines, suppressed; // writer thread state for rate limiting
+		char last[TEXT_LEN];
+		long long lastNs, secondNs;
+	};
+	std::vector<SRing*> rings;
+	ZL_Mutex mtx;
+	std::thread thread;
+	std::atomic<bool> quit;
+	std::atomic<retro_log_level> minLevel; // read by every logging thread
+	long long startNs;
+	std::string path;
+	FILE* f;
+	size_t fileSize;
+
+	SRing* GetRing()
+	{
+		// The plain thread locals stay valid while the thread ends, so logging from later thread local destructors is dropped
+		// instead of writing into a ring that the writer thread may already have freed
+		static thread_local SRing* tlsRing;
+		static thread_local bool tlsEnded;
+		static thread_local struct SOwner { ~SOwner() { if (tlsRing) tlsRing->exited.store(true, std::memory_order_release); tlsRing = NULL; tlsEnded = true; } } owner;
+		(void)owner;
+		if (tlsRing || tlsEnded) return tlsRing;
+		SRing* r = new SRing;
+		r->head = r->tail = r->dropped = 0;
+		r->exited = false;
+		r->repeats = r->lines = r->suppressed = 0;
+		r->last[0] = '\0';
+		r->lastNs = r->secondNs = 0;
+		mtx.Lock(); // only once per thread
+		r->idx = (unsigned)rings.size();
+		rings.push_back(r);
+		mtx.Unlock();
+		return (tlsRing = r);
+	}
+
+	void VPrintf(retro_log_level level, const char* fmt, va_list ap)
+	{
+		if (level < minLevel.load(std::memory_order_relaxed)) return; // don't format messages that would be filtered anyway
+		SRing* r = GetRing();
+		if (!r) return; // thread is ending
+		const unsigned h = r->head.load(std::memory_order_relaxed);
+		if (h - r->tail.load(std::memory_order_acquire) >= RING_SIZE) { r->dropped.fetch_add(1, std::memory_order_relaxed); return; } // writer is behind, never wait
+		SEntry& e = r->entries[h % RING_SIZE];
+		e.ns = STrace::Now();
+		e.level = level;
+		int len = vsnprintf(e.text, TEXT_LEN, fmt, ap);
+		if (len > TEXT_LEN - 1) len = TEXT_LEN - 1;
+		while (len > 0 && (e.text[len - 1] == '\n' || e.text[len - 1] == '\r')) e.text[--len] = '\0'; // the core ends its messages with a line break
+		r->head.store(h + 1, std::memory_order_release);
+	}
+
+	void Printf(retro_log_level level, const char* fmt, ...)
+	{
+		va_list ap;
+		va_start(ap, fmt);
+		VPrintf(level, fmt, ap);
+		va_end(ap);
+	}
+
+	static void RETRO_CALLCONV LogCallback(enum retro_log_level level, const char* fmt, ...);
+
+	void Start()
+	{
+		GetRing(); // register the main thread first
+		const char l = (ZL_Application::SettingsGet("log_level").c_str()[0]|0x20); // 'd'ebug, 'i'nfo, 'w'arn, 'e'rror (read at startup)
+		minLevel = (l == 'd' ? RETRO_LOG_DEBUG : l == 'w' ? RETRO_LOG_WARN : l == 'e' ? RETRO_LOG_ERROR : RETRO_LOG_INFO);
+		startNs = STrace::Now();
+		path = (std::string(PathSaves) += '/').append("DOSBoxPure.log");
+		quit = false;
+		thread = std::thread(Run, this);
+	}
+
+	void Stop()
+	{
+		if (!thread.joinable()) return;
+		quit = true;
+		thread.join();
+	}
+
+	void Write(const SRing* r, const SEntry* e, const char* text)
+	{
+		if (!f)
+		{
+			if ((f = fopen_wrap(path.c_str(), "ab")) == NULL) return;
+			fseek(f, 0, SEEK_END);
+			fileSize = (size_t)ftell(f);
+		}
+		static const char levels[] = "DIWE";
+		const long long ns = (e ? e->ns : STrace::Now()) - startNs;
+		int n = fprintf(f, "[%8.3f] [%c] [T%u] %s\n", ns / 1000000000.0, (e ? levels[e->level & 3] : '-'), r->idx, text);
+		if (n > 0) fileSize += (size_t)n;
+		if (fileSize < MAX_FILE_SIZE) return;
+
+		// Rotate DOSBoxPure.log -> DOSBoxPure.log.1 -> DOSBoxPure.log.2
+		fclose(f);
+		f = NULL;
+		for (int i = BACKUPS; i; i--)
+		{
+			std::string from = path, to = path;
+			if (i > 1) from.append(".").append(1, (char)('0' + i - 1));
+			to.append(".").append(1, (char)('0' + i));
+			remove(to.c_str());
+			rename(from.c_str(), to.c_str());
+		}
+	}
+
+	void FlushRepeats(SRing* r)
+	{
+		char buf[64];
+		if (r->repeats) { snprintf(buf, sizeof(buf), "(last message repeated %u times)", r->repeats); Write(r, NULL, buf); r->repeats = 0; }
+		if (r->suppressed) { snprintf(buf, sizeof(buf), "(%u messages suppressed)", r->suppressed); Write(r, NULL, buf); r->suppressed = 0; }
+		if (unsigned dropped = r->dropped.exchange(0, std::memory_order_relaxed)) { snprintf(buf, sizeof(buf), "(%u messages dropped)", dropped); Write(r, NULL, buf); }
+	}
+
+	void Drain()
+	{
+		mtx.Lock();
+		std::vector<SRing*> drain(rings);
+		mtx.Unlock();
+		std::vector<SRing*> ended;
+		for (SRing* r : drain)
+		{
+			const bool exited = r->exited.load(std::memory_order_acquire); // read before head so nothing gets pushed after the drain
+			const unsigned h = r->head.load(std::memory_order_acquire);
+			for (unsigned t = r->tail.load(std::memory_order_relaxed); t != h; t++)
+			{
+				const SEntry& e = r->entries[t % RING_SIZE];
+				if (e.level < minLevel.load(std::memory_order_relaxed)) continue;
+				if (!strcmp(e.text, r->last) && e.ns - r->lastNs < 1000000000LL) { r->repeats++; r->lastNs = e.ns; continue; } // identical message within a second
+				if (e.ns - r->secondNs >= 1000000000LL) { FlushRepeats(r); r->secondNs = e.ns; r->lines = 0; }
+				else if (r->repeats) FlushRepeats(r);
+				if (++r->lines > MAX_LINES_PER_SEC) { r->suppressed++; continue; }
+				Write(r, &e, e.text);
+				memcpy(r->last, e.text, TEXT_LEN);
+				r->lastNs = e.ns;
+			}
+			r->tail.store(h, std::memory_order_release);
+			if (exited) { FlushRepeats(r); ended.push_back(r); continue; }
+			if (r->dropped.load(std::memory_order_relaxed) || (r->repeats && STrace::Now() - r->lastNs >= 1000000000LL)) FlushRepeats(r);
+		}
+		if (!ended.empty())
+		{
+			// Free the rings of threads that ended
+			mtx.Lock();
+			for (SRing* r : ended) { rings.erase(std::find(rings.begin(), rings.end(), r)); delete r; }
+			mtx.Unlock();
+		}
+		if (f) fflush(f);
+	}
+
+	static void Run(SLog* self)
+	{
+		for (bool last = false; !last;)
+		{
+			last = self->quit.load();
+			self->Drain();
+			if (!last) std::this_thread::sleep_for(std::chrono::milliseconds(50));
+		}
+		self->mtx.Lock();
+		for (SRing* r : self->rings) self->FlushRepeats(r);
+		self->mtx.Unlock();
+		if (self->f) { fclose(self->f); self->f = NULL; }
+	}
+} Log;
+
+void RETRO_CALLCONV SLog::LogCallback(enum retro_log_level level, const char* fmt, ...)
+{
+	va_list ap;
+	va_start(ap, fmt);
+	Log.VPrintf(level, fmt, ap);
+	va_end(ap);
+}
 
 struct SJoyBind
 {
@@ -401,16 +1007,19 @@ struct SJoyBind
 	}
 	void Describe(std::string& outJoyName, std::string& outBind, const char* prefix, const char* bindname = NULL) const
 	{
+		// Formatted into a stack buffer and assigned so the strings passed by the OSD keep their capacity and don't allocate on every redraw
 		outJoyName.assign(prefix).append(Joy ? Joy->name : "<Disconnected Controller>");
-		if (bindname) { ZL_String::format((ZL_String&)outBind, "%s%s", prefix, bindname); return; }
+		char buf[128];
+		if (bindname) { outBind.assign(prefix).append(bindname); return; }
 		switch (From)
 		{
-			case FROM_AXIS:   ZL_String::format((ZL_String&)outBind, "%sAxis %d %stive",    prefix, (Num + 1), (Dir == 1 ? "Posi" : "Nega")); break;
-			case FROM_HAT:    ZL_String::format((ZL_String&)outBind, "%sHat %d %s",         prefix, (Num + 1), (Dir == ZL_HAT_UP ? "Up" : Dir == ZL_HAT_RIGHT ? "Right" : Dir == ZL_HAT_DOWN ? "Down" : "Left")); break;
-			case FROM_BALL:   ZL_String::format((ZL_String&)outBind, "%sBall %d %c %stive", prefix, (Num + 1), (ZL_Math::Abs(Dir) == 1 ? 'X' : 'Y'), (Dir > 0 ? "Posi" : "Nega")); break;
-			case FROM_BUTTON: ZL_String::format((ZL_String&)outBind, "%sButton %d",         prefix, (Num + 1), (Dir == 1 ? "Posi" : "Nega")); break;
-			default:break;
+			case FROM_AXIS:   snprintf(buf, sizeof(buf), "%sAxis %d %stive",    prefix, (Num + 1), (Dir == 1 ? "Posi" : "Nega")); break;
+			case FROM_HAT:    snprintf(buf, sizeof(buf), "%sHat %d %s",         prefix, (Num + 1), (Dir == ZL_HAT_UP ? "Up" : Dir == ZL_HAT_RIGHT ? "Right" : Dir == ZL_HAT_DOWN ? "Down" : "Left")); break;
+			case FROM_BALL:   snprintf(buf, sizeof(buf), "%sBall %d %c %stive", prefix, (Num + 1), (ZL_Math::Abs(Dir) == 1 ? 'X' : 'Y'), (Dir > 0 ? "Posi" : "Nega")); break;
+			case FROM_BUTTON: snprintf(buf, sizeof(buf), "%sButton %d",         prefix, (Num + 1)); break;
+			default: return;
 		}
+		outBind.assign(buf);
 	}
 	ZL_String ToConfig() const
 	{
@@ -451,9 +1060,79 @@ enum { BIND_PORT0 = 0, _BIND_PORTS = 4 };
 enum EBindId { BIND_ID_UP, BIND_ID_DOWN, BIND_ID_LEFT, BIND_ID_RIGHT, BIND_ID_B, BIND_ID_A, BIND_ID_Y, BIND_ID_X, BIND_ID_SELECT, BIND_ID_START, BIND_ID_L, BIND_ID_R, BIND_ID_L2, BIND_ID_R2, BIND_ID_L3, BIND_ID_R3, BIND_ID_LSTICK_UP, BIND_ID_LSTICK_DOWN, BIND_ID_LSTICK_LEFT, BIND_ID_LSTICK_RIGHT, BIND_ID_RSTICK_UP, BIND_ID_RSTICK_DOWN, BIND_ID_RSTICK_LEFT, BIND_ID_RSTICK_RIGHT, _BIND_ID_COUNT, _BIND_ID_FIRST_AXIS = BIND_ID_LSTICK_UP };
 static const char* BindName[] = { "up", "down", "left", "right", "b", "a", "y", "x", "select", "start", "l", "r", "l2", "r2", "l3", "r3", "lstickup", "lstickdown", "lstickleft", "lstickright", "rstickup", "rstickdown", "rstickleft", "rstickright" };
 static SJoyBind JoyBinds[_BIND_PORTS][_BIND_ID_COUNT], *CaptureJoyBind;
-static std::vector<unsigned char> CaptureJoyState;
 static const char** JoyBindTemplateNames;
 
+// Bind capture keeps a copy of the raw state of all joysticks and only looks at inputs that changed since the previous query
+// Every input direction counts its changes from the state when capturing started and is chosen when released after a press
+static struct SCaptureJoy
+{
+	struct SDevice { ZL_JoystickData* joy; size_t raw, state; }; // offsets into the buffers preallocated when capturing starts
+	std::vector<SDevice> devices;
+	std::vector<unsigned char> raw, state;
+
+	void Start()
+	{
+		size_t rawSize = 0, stateSize = 0;
+		devices.clear();
+		for (ZL_JoystickData* j : vecJoys)
+		{
+			devices.push_back({ j, rawSize, stateSize });
+			rawSize += j->naxes * sizeof(*j->axes) + j->nhats * sizeof(*j->hats) + j->nballs * sizeof(*j->balls) + j->nbuttons * sizeof(*j->buttons);
+			stateSize += j->naxes * 2 + j->nhats * 4 + j->nballs * 4 + j->nbuttons;
+		}
+		raw.resize(rawSize);
+		state.resize(stateSize);
+		SJoyBind unused;
+		Scan(true, unused);
+	}
+
+	static bool Update(ZL_JoystickData* j, SJoyBind::EFrom from, int num, unsigned char* w, bool init, SJoyBind& out)
+	{
+		static const signed char dirsAxis[] = { -1, 1 }, dirsHat[] = { ZL_HAT_UP, ZL_HAT_RIGHT, ZL_HAT_DOWN, ZL_HAT_LEFT }, dirsBall[] = { -2, -1, 1, 2 }, dirsButton[] = { 0 };
+		static const signed char *dirs[] = { NULL, dirsAxis, dirsHat, dirsBall, dirsButton };
+		static const unsigned char dirsCount[] = { 0, COUNT_OF(dirsAxis), COUNT_OF(dirsHat), COUNT_OF(dirsBall), COUNT_OF(dirsButton) };
+		SJoyBind tst = { NULL }; // zero bytes including padding
+		tst.Joy = j; tst.From = from; tst.Num = (unsigned char)num;
+		for (int d = 0; d != dirsCount[from]; d++, w++)
+		{
+			tst.Dir = dirs[from][d];
+			const unsigned char v = (unsigned char)tst.GetVal(false);
+			if (init) *w = v;
+			else if (v != (*w & 1)) { if (*w < 2 || v) *w += 3; else { out = tst; return true; } }
+		}
+		return false;
+	}
+
+	bool Scan(bool init, SJoyBind& out)
+	{
+		// Comparing whole arrays first makes a query cost next to nothing while no input changes
+		for (const SDevice& d : devices)
+		{
+			ZL_JoystickData* j = d.joy;
+			unsigned char *r = raw.data() + d.raw, *w = state.data() + d.state;
+			auto segment = [&](SJoyBind::EFrom from, const void* src, int count, size_t size, int dirs) -> bool
+			{
+				const unsigned char* p = (const unsigned char*)src;
+				if (count && (init || memcmp(r, p, count * size)))
+					for (int n = 0; n != count; n++)
+					{
+						if (!init && !memcmp(r + n * size, p + n * size, size)) continue;
+						memcpy(r + n * size, p + n * size, size);
+						if (Update(j, from, n, w + n * dirs, init, out)) return true;
+					}
+				r += count * size;
+				w += count * dirs;
+				return false;
+			};
+			if (segment(SJoyBind::FROM_AXIS,   j->axes,    j->naxes,    sizeof(*j->axes),    2)
+			 || segment(SJoyBind::FROM_HAT,    j->hats,    j->nhats,    sizeof(*j->hats),    4)
+			 || segment(SJoyBind::FROM_BALL,   j->balls,   j->nballs,   sizeof(*j->balls),   4)
+			 || segment(SJoyBind::FROM_BUTTON, j->buttons, j->nbuttons, sizeof(*j->buttons), 1)) return true;
+		}
+		return false;
+	}
+} CaptureJoy;
+
 static SJoyBind JoyBindTemplateXInput[_BIND_ID_COUNT] = {
 	{ NULL, SJoyBind::FROM_BUTTON,    0 }, { NULL, SJoyBind::FROM_BUTTON,    1 }, { NULL, SJoyBind::FROM_BUTTON,    2 }, { NULL, SJoyBind::FROM_BUTTON,    3 }, // DPAD
 	{ NULL, SJoyBind::FROM_BUTTON,   10 }, { NULL, SJoyBind::FROM_BUTTON,   11 }, { NULL, SJoyBind::FROM_BUTTON,   12 }, { NULL, SJoyBind::FROM_BUTTON,   13 }, // BAYX
@@ -482,8 +1161,221 @@ static const char* JoyBindTemplatePS4Names[] = {
 	"Left Stick Up", "Left Stick Down", "Left Stick Left", "Left Stick Right", "Right Stick Up", "Right Stick Down", "Right Stick Left", "Right Stick Right", // LSTICK,RSTICK
 };
 
-static inline void DirtySettings() { dirtySettingsTick = ZLTICKS + 10000; }
-static inline void SynchronizeSettings(bool force) { if (dirtySettingsTick && (force || ZLPASSED(dirtySettingsTick))) { ZL_Application::SettingsSynchronize(); dirtySettingsTick = 0; } }
+// Settings are written by a background thread so the frame loop never waits for the disk, bursts of changes are coalesced until
+// none happened for a second and the last complete DOSBoxPure.cfg is kept as DOSBoxPure.cfg.bak (renamed away before writing)
+// ZillaLib writes the file in place, so DOSBoxPure.cfg.writing exists while it does and tells the next start to restore the backup
+// While the file is written the settings are frozen, changes made meanwhile are kept in a pending list and applied afterwards
+static struct SSettingsWriter
+{
+	enum { COALESCE_USEC = 1000000 };
+	struct SPending { std::string key, value; bool del; };
+	std::string path;
+	std::thread thread;
+	std::atomic<bool> quit, now;
+	std::atomic<unsigned> changes, written;
+	std::atomic<retro_time_t> lastChange;
+	ZL_Mutex mtxWrite; // held while writing so a flush from the main thread doesn't overlap the thread
+	ZL_Mutex mtxSettings; // guards access to the ZillaLib settings but is never held during disk access
+	bool syncing, complete; // settings are being written (frozen), the file on disk is from a completed write
+	std::vector<SPending> pending;
+	std::vector<std::pair<std::string, std::string> > files; // small side files (path and content, empty to delete) written by the thread
+	ZL_Mutex mtxFiles;
+	std::atomic<bool> haveFiles;
+
+	void Start(const std::string& cfgPath)
+	{
+		path = cfgPath;
+		complete = (FileSize(path) > 0);
+		quit = false;
+		thread = std::thread(Run, this);
+	}
+
+	void Stop()
+	{
+		if (!thread.joinable()) return;
+		quit = true;
+		thread.join();
+	}
+
+	SPending* FindPending(const char* key)
+	{
+		for (SPending& p : pending) if (p.key == key) return &p;
+		return NULL;
+	}
+
+	ZL_String Get(const char* key)
+	{
+		mtxSettings.Lock();
+		const SPending* p = FindPending(key);
+		ZL_String res = (!p ? ZL_Application::SettingsGet(key) : p->del ? ZL_String() : ZL_String(p->value.c_str())); // lookups only read
+		mtxSettings.Unlock();
+		return res;
+	}
+
+	bool Has(const char* key)
+	{
+		mtxSettings.Lock();
+		const SPending* p = FindPending(key);
+		const bool res = (p ? !p->del : ZL_Application::SettingsHas(key));
+		mtxSettings.Unlock();
+		return res;
+	}
+
+	void Change(const char* key, const char* value)
+	{
+		// Changes go to ZillaLib directly unless a write is going on, nothing here waits for the disk
+		mtxSettings.Lock();
+		if (!syncing && pending.empty())
+		{
+			if (value) ZL_Application::SettingsSet(key, value);
+			else ZL_Application::SettingsDel(key);
+		}
+		else if (SPending* p = FindPending(key)) { p->value = (value ? value : ""); p->del = !value; }
+		else { SPending np = { key, (value ? value : ""), !value }; pending.push_back(np); }
+		mtxSettings.Unlock();
+	}
+
+	void Set(const char* key, const char* value) { Change(key, value); }
+	void Set(const char* key, const ZL_String& value) { Change(key, value.c_str()); }
+	void Set(const char* key, int value) { Change(key, ZL_String::format("%d", value).c_str()); }
+	void Del(const char* key) { Change(key, NULL); }
+
+	void Dirty()
+	{
+		lastChange.store(dbp_cpu_features_get_time_usec());
+		changes.fetch_add(1);
+	}
+
+	void Flush(bool wait)
+	{
+		if (ReadOnlySettings) return;
+		if (!wait && thread.joinable()) { now = true; return; } // let the thread write right away
+		Write();
+		WriteFiles();
+	}
+
+	void QueueFile(const std::string& filePath, const std::string& content)
+	{
+		mtxFiles.Lock();
+		std::vector<std::pair<std::string, std::string> >::iterator it = files.begin();
+		while (it != files.end() && it->first != filePath) ++it;
+		if (it != files.end()) it->second = content; // only the latest content of a file is written
+		else files.push_back(std::make_pair(filePath, content));
+		haveFiles = true;
+		mtxFiles.Unlock();
+		if (!thread.joinable()) WriteFiles();
+	}
+
+	void WriteFiles()
+	{
+		mtxFiles.Lock();
+		std::vector<std::pair<std::string, std::string> > todo;
+		todo.swap(files);
+		haveFiles = false;
+		mtxFiles.Unlock();
+		for (const std::pair<std::string, std::string>& it : todo)
+		{
+			if (it.second.empty()) { remove(it.first.c_str()); continue; }
+			if (FILE* f = fopen_wrap(it.first.c_str(), "wb")) { fwrite(it.second.c_str(), it.second.size(), 1, f); fclose(f); }
+		}
+	}
+
+	static bool MoveOver(const std::string& from, const std::string& to)
+	{
+		#if defined(_MSC_VER) || defined(__MINGW32__) || defined(__WIN32__) || defined(WIN32) || defined(_WIN32)
+		extern wchar_t* utf8_to_utf16_string_alloc(const char*);
+		wchar_t *wfrom = utf8_to_utf16_string_alloc(from.c_str()), *wto = utf8_to_utf16_string_alloc(to.c_str());
+		const bool res = (wfrom && wto && MoveFileExW(wfrom, wto, MOVEFILE_REPLACE_EXISTING | MOVEFILE_WRITE_THROUGH));
+		free(wfrom); free(wto);
+		return res;
+		#else
+		return (rename(from.c_str(), to.c_str()) == 0);
+		#endif
+	}
+
+	static long FileSize(const std::string& filePath)
+	{
+		FILE* f = fopen_wrap(filePath.c_str(), "rb");
+		if (!f) return -1;
+		fseek(f, 0, SEEK_END);
+		const long size = ftell(f);
+		fclose(f);
+		return size;
+	}
+
+	static bool CopyOver(const std::string& from, const std::string& to, const std::string& tmp)
+	{
+		// Copy through a temp file which is renamed so a crash at any point leaves a complete target file
+		const long size = FileSize(from);
+		if (size <= 0) return false; // keep an existing file instead of an empty one
+		std::vector<char> buf((size_t)size);
+		FILE* f = fopen_wrap(from.c_str(), "rb");
+		const bool haveFile = (f && fread(&buf[0], buf.size(), 1, f) == 1);
+		if (f) fclose(f);
+		if (!haveFile) return false;
+		FILE* t = fopen_wrap(tmp.c_str(), "wb");
+		bool ok = (t && fwrite(&buf[0], buf.size(), 1, t) == 1);
+		if (t) { ok &= (fflush(t) == 0); fclose(t); }
+		if (ok && MoveOver(tmp, to)) return true;
+		remove(tmp.c_str());
+		return false;
+	}
+
+	void Write()
+	{
+		mtxWrite.Lock();
+		const unsigned c = changes.load();
+		if (c != written.load())
+		{
+			TRACE_SCOPE("SettingsWrite");
+			// The last complete file becomes the backup, an incomplete one (failed write) is not rotated over a good backup
+			if (complete) MoveOver(path, path + ".bak");
+			const std::string marker = path + ".writing";
+			FILE* m = fopen_wrap(marker.c_str(), "wb");
+			if (m) fclose(m);
+			mtxSettings.Lock();
+			syncing = true;
+			mtxSettings.Unlock();
+			ZL_Application::SettingsSynchronize();
+			mtxSettings.Lock();
+			for (const SPending& p : pending)
+			{
+				if (p.del) ZL_Application::SettingsDel(p.key.c_str());
+				else ZL_Application::SettingsSet(p.key.c_str(), p.value.c_str());
+			}
+			pending.clear();
+			syncing = false;
+			mtxSettings.Unlock();
+			if (m) remove(marker.c_str());
+			complete = (FileSize(path) > 0);
+			written = c; // changes made during the write increased the counter and get written next
+		}
+		mtxWrite.Unlock();
+	}
+
+	static void Run(SSettingsWriter* self)
+	{
+		while (!self->quit.load())
+		{
+			std::this_thread::sleep_for(std::chrono::milliseconds(100));
+			if (self->haveFiles.load()) self->WriteFiles();
+			if (self->changes.load() == self->written.load()) continue;
+			if (self->now.exchange(false) || dbp_cpu_features_get_time_usec() - self->lastChange.load() >= COALESCE_USEC) self->Write();
+		}
+	}
+
+	static void Recover(const std::string& cfgPath)
+	{
+		// Restore the backup if the settings file got lost or a crash interrupted writing it (which may leave it truncated)
+		const std::string marker = cfgPath + ".writing";
+		const bool interrupted = (FileSize(marker) >= 0);
+		if ((interrupted || FileSize(cfgPath) <= 0) && CopyOver(cfgPath + ".bak", cfgPath, cfgPath + ".tmp")) // copy to keep the backup
+			fprintf(stderr, "Restored settings from %s.bak\n", cfgPath.c_str());
+		if (interrupted) remove(marker.c_str());
+	}
+} SettingsWriter;
+
+static inline void DirtySettings() { SettingsWriter.Dirty(); }
 
 static EBindId GetBindIdFromRetro(unsigned device, unsigned index, unsigned id, bool axispos = false)
 {
@@ -523,26 +1415,152 @@ static EBindId GetBindIdFromRetro(unsigned device, unsigned index, unsigned id,
 	return _BIND_ID_COUNT;
 }
 
-static void RefreshJoysticks()
+// Optional input thread (input_thread=true) polling the joysticks at up to 1 kHz and queueing timestamped button, hat and axis changes
+// The frame loop drains the queue before retro_run so presses shorter than a frame are not lost and the input age can be measured
+static struct SInputThread
 {
-	int oldcount = (int)vecJoys.size(), matches = 0;
-	for (int devidx = 0; devidx < ZL_Joystick::NumJoysticks(); devidx++)
+	enum { QUEUE_SIZE = 1024, POLL_USEC = 1000 };
+	enum EType : unsigned char { BUTTON, HAT, AXIS };
+	struct SEvent { retro_time_t usec; ZL_JoystickData* joy; EType type; unsigned char num; short value; };
+	struct SLatch // presses and axis extremes seen since the last input poll of the core
 	{
-		ZL_JoystickData* joy = ZL_Joystick::JoystickOpen(devidx);
-		if (!joy) continue; // was just disconnected?
-		int knownidx = -1;
-		for (ZL_JoystickData*& it : vecJoys) { if (it == joy) { knownidx = (int)(&it - &vecJoys[0]); break; } }
-		if (knownidx != -1) ZL_Joystick::JoystickClose(joy); // was already open, reduce refcount
-		else { knownidx = (int)vecJoys.size(); vecJoys.push_back(joy); } // new joystick
-		if (knownidx != matches) { joy = vecJoys[knownidx]; vecJoys[knownidx] = vecJoys[matches]; vecJoys[matches] = joy; } // swap into match pos
-		matches++;
+		ZL_JoystickData* joy; Bit64u buttons; unsigned char hats[4]; short axisMin[8], axisMax[8];
+		void Reset() { buttons = 0; memset(hats, 0, sizeof(hats)); memset(axisMin, 0, sizeof(axisMin)); memset(axisMax, 0, sizeof(axisMax)); }
+	};
+	SEvent queue[QUEUE_SIZE];
+	std::atomic<unsigned> head, tail, dropped;
+	std::thread thread;
+	std::atomic<bool> quit;
+	ZL_Mutex mtx; // held while polling and while the main thread changes the joystick list
+	std::vector<ZL_JoystickData*> joys; // copy of vecJoys for the thread
+	unsigned joysChanges; // increased with every change of joys (under mtx)
+	std::vector<SLatch> latches;
+	float ageMs; unsigned events; // average event age at the last drain and number of events
+
+	bool Active() const { return thread.joinable(); }
+
+	void Start()
+	{
+		if (Active()) return;
+		head = tail = dropped = 0;
+		quit = false;
+		thread = std::thread(Run, this);
 	}
-	if (oldcount == (int)vecJoys.size() && matches == oldcount) return; // nothing changed
 
-	for (int i = (int)vecJoys.size(); i-- != matches;) // disconnect old
+	void Stop()
 	{
-		ZL_JoystickData* oldjoy = vecJoys[i];
-		for (int idx = 0; idx != _BIND_PORTS * _BIND_ID_COUNT; idx++)
+		if (!Active()) return;
+		quit = true;
+		thread.join();
+	}
+
+	void Push(const SEvent& e)
+	{
+		const unsigned h = head.load(std::memory_order_relaxed);
+		if (h - tail.load(std::memory_order_acquire) >= QUEUE_SIZE) { dropped.fetch_add(1, std::memory_order_relaxed); return; }
+		queue[h % QUEUE_SIZE] = e;
+		head.store(h + 1, std::memory_order_release);
+	}
+
+	static void Run(SInputThread* self)
+	{
+		struct SPrev { ZL_JoystickData* joy; Bit64u buttons; unsigned char hats[4]; short axes[8]; };
+		std::vector<SPrev> prev;
+		unsigned prevChanges = 0;
+		while (!self->quit.load(std::memory_order_relaxed))
+		{
+			const retro_time_t start = dbp_cpu_features_get_time_usec();
+			self->mtx.Lock();
+			SDL_LockJoysticks(); // the event pump of the main thread updates the same joysticks
+			SDL_JoystickUpdate();
+			if (prevChanges != self->joysChanges) { prev.clear(); prevChanges = self->joysChanges; } // pointers may have been reused
+			if (prev.size() != self->joys.size()) prev.resize(self->joys.size());
+			for (size_t i = 0; i != self->joys.size(); i++)
+			{
+				ZL_JoystickData* j = self->joys[i];
+				SPrev& p = prev[i];
+				if (p.joy != j) { memset(&p, 0, sizeof(p)); p.joy = j; }
+				for (int n = 0, nMax = ZL_Math::Min(j->nbuttons, 64); n != nMax; n++)
+					if (((p.buttons >> n) & 1) != (j->buttons[n] ? 1u : 0u)) { p.buttons ^= (1ull << n); self->Push({ start, j, BUTTON, (unsigned char)n, (short)(j->buttons[n] ? 1 : 0) }); }
+				for (int n = 0, nMax = ZL_Math::Min(j->nhats, 4); n != nMax; n++)
+					if (p.hats[n] != j->hats[n]) { p.hats[n] = j->hats[n]; self->Push({ start, j, HAT, (unsigned char)n, (short)j->hats[n] }); }
+				for (int n = 0, nMax = ZL_Math::Min(j->naxes, 8); n != nMax; n++)
+					if (ZL_Math::Abs(p.axes[n] - j->axes[n]) > 256) { p.axes[n] = j->axes[n]; self->Push({ start, j, AXIS, (unsigned char)n, j->axes[n] }); } // ignore jitter
+			}
+			SDL_UnlockJoysticks();
+			self->mtx.Unlock();
+			const retro_time_t spent = dbp_cpu_features_get_time_usec() - start;
+			if (spent < POLL_USEC) std::this_thread::sleep_for(std::chrono::microseconds(POLL_USEC - spent));
+		}
+	}
+
+	SLatch& GetLatch(ZL_JoystickData* joy)
+	{
+		for (SLatch& l : latches) if (l.joy == joy) return l;
+		latches.push_back(SLatch());
+		latches.back().joy = joy;
+		latches.back().Reset();
+		return latches.back();
+	}
+
+	void DropStale()
+	{
+		// Called with mtx held after joysticks were added or removed, a new joystick can reuse the pointer of a removed one so
+		// latches and queued events from before must not be matched against it (the thread doesn't push while mtx is held)
+		latches.clear();
+		joysChanges++;
+		tail.store(head.load(std::memory_order_acquire), std::memory_order_release);
+	}
+
+	void Drain()
+	{
+		const unsigned h = head.load(std::memory_order_acquire), t = tail.load(std::memory_order_relaxed);
+		if (h == t) return;
+		const retro_time_t now = dbp_cpu_features_get_time_usec();
+		retro_time_t age = 0;
+		for (unsigned i = t; i != h; i++)
+		{
+			const SEvent& e = queue[i % QUEUE_SIZE];
+			age += now - e.usec;
+			if (e.type == BUTTON && e.value) GetLatch(e.joy).buttons |= (1ull << e.num);
+			if (e.type == HAT) GetLatch(e.joy).hats[e.num & 3] |= (unsigned char)e.value;
+			if (e.type == AXIS) { SLatch& l = GetLatch(e.joy); l.axisMin[e.num & 7] = ZL_Math::Min(l.axisMin[e.num & 7], e.value); l.axisMax[e.num & 7] = ZL_Math::Max(l.axisMax[e.num & 7], e.value); }
+		}
+		tail.store(h, std::memory_order_release);
+		events = h - t;
+		ageMs = (float)(age / 1000.0 / events);
+	}
+
+	bool Latched(const SJoyBind& bnd) const
+	{
+		for (const SLatch& l : latches)
+			if (l.joy == bnd.Joy)
+				return ((bnd.From == SJoyBind::FROM_BUTTON && bnd.Num < 64 && ((l.buttons >> bnd.Num) & 1)) || (bnd.From == SJoyBind::FROM_HAT && bnd.Num < 4 && (l.hats[bnd.Num] & bnd.Dir))
+					|| (bnd.From == SJoyBind::FROM_AXIS && bnd.Num < 8 && (bnd.Dir > 0 ? l.axisMax[bnd.Num] : -l.axisMin[bnd.Num]) >= 12000)); // same threshold as SJoyBind::GetVal
+		return false;
+	}
+} InputThread;
+
+static void UpdateJoysticks()
+{
+	int oldcount = (int)vecJoys.size(), matches = 0;
+	for (int devidx = 0; devidx < ZL_Joystick::NumJoysticks(); devidx++)
+	{
+		ZL_JoystickData* joy = ZL_Joystick::JoystickOpen(devidx);
+		if (!joy) continue; // was just disconnected?
+		int knownidx = -1;
+		for (ZL_JoystickData*& it : vecJoys) { if (it == joy) { knownidx = (int)(&it - &vecJoys[0]); break; } }
+		if (knownidx != -1) ZL_Joystick::JoystickClose(joy); // was already open, reduce refcount
+		else { knownidx = (int)vecJoys.size(); vecJoys.push_back(joy); } // new joystick
+		if (knownidx != matches) { joy = vecJoys[knownidx]; vecJoys[knownidx] = vecJoys[matches]; vecJoys[matches] = joy; } // swap into match pos
+		matches++;
+	}
+	if (oldcount == (int)vecJoys.size() && matches == oldcount) return; // nothing changed
+
+	for (int i = (int)vecJoys.size(); i-- != matches;) // disconnect old
+	{
+		ZL_JoystickData* oldjoy = vecJoys[i];
+		for (int idx = 0; idx != _BIND_PORTS * _BIND_ID_COUNT; idx++)
 		{
 			int bindPort = (idx / _BIND_ID_COUNT), bindId = (idx % _BIND_ID_COUNT);
 			if (JoyBinds[bindPort][bindId].Joy == oldjoy) { JoyBinds[bindPort][bindId].Joy = NULL; JoyBinds[bindPort][bindId].From = SJoyBind::FROM_NONE; }
@@ -564,7 +1582,7 @@ static void RefreshJoysticks()
 	if      (joyXInput) { for (SJoyBind& it : JoyBindTemplateXInput) { it.Joy = joyXInput; } bindtemplate = JoyBindTemplateXInput; JoyBindTemplateNames = JoyBindTemplateXInputNames; }
 	else if (joyPS4)    { for (SJoyBind& it : JoyBindTemplatePS4)    { it.Joy = joyPS4;    } bindtemplate = JoyBindTemplatePS4;    JoyBindTemplateNames = JoyBindTemplatePS4Names;    }
 
-	bool useCustomControllerBinding = (((*ZL_Application::SettingsGet("custom_controller_bindings").c_str())|0x20) == 't'); // 't'rue
+	bool useCustomControllerBinding = (((*SettingsWriter.Get("custom_controller_bindings").c_str())|0x20) == 't'); // 't'rue
 	if (useCustomControllerBinding)
 	{
 		char key[100], have_primary = 0, have_secondary = 0;
@@ -572,18 +1590,18 @@ static void RefreshJoysticks()
 		{
 			int bindPort = (idx / _BIND_ID_COUNT), bindId = (idx % _BIND_ID_COUNT);
 			sprintf(key, "bind_port_%d_%s", (bindPort + 1), BindName[bindId]);
-			if (!ZL_Application::SettingsHas(key)) continue;
+			if (!SettingsWriter.Has(key)) continue;
 			(bindPort ? have_secondary : have_primary) = 1;
-			JoyBinds[bindPort][bindId] = SJoyBind::FromConfig(ZL_Application::SettingsGet(key));
+			JoyBinds[bindPort][bindId] = SJoyBind::FromConfig(SettingsWriter.Get(key));
 		}
 		if (have_primary && !have_secondary && bindtemplate && !memcmp(JoyBinds[0], bindtemplate, sizeof(JoyBinds[0])))
 		{
-			for (int bindId = 0; bindId != _BIND_ID_COUNT; bindId++) { sprintf(key, "bind_port_%d_%s", (0 + 1), BindName[bindId]); ZL_Application::SettingsDel(key); DirtySettings(); }
+			for (int bindId = 0; bindId != _BIND_ID_COUNT; bindId++) { sprintf(key, "bind_port_%d_%s", (0 + 1), BindName[bindId]); SettingsWriter.Del(key); DirtySettings(); }
 			have_primary = false;
 		}
 		if (!have_primary)
 		{
-			if (!have_secondary && ZL_Application::SettingsHas("custom_controller_bindings")) { ZL_Application::SettingsDel("custom_controller_bindings"); DirtySettings(); }
+			if (!have_secondary && SettingsWriter.Has("custom_controller_bindings")) { SettingsWriter.Del("custom_controller_bindings"); DirtySettings(); }
 			useCustomControllerBinding = false; // apply template below if needed
 		}
 	}
@@ -594,6 +1612,17 @@ static void RefreshJoysticks()
 		JoyBindTemplateNames = NULL;
 }
 
+static void RefreshJoysticks()
+{
+	// The input thread must not poll a joystick while it gets closed
+	InputThread.mtx.Lock();
+	UpdateJoysticks();
+	InputThread.joys = vecJoys;
+	InputThread.DropStale();
+	InputThread.mtx.Unlock();
+	if (CaptureJoyBind) CaptureJoy.Start();
+}
+
 static void SetCaptureJoyBind(const SJoyBind& setbind)
 {
 	if (!memcmp(CaptureJoyBind, &setbind, sizeof(SJoyBind))) { CaptureJoyBind = NULL; return; }
@@ -605,16 +1634,16 @@ static void SetCaptureJoyBind(const SJoyBind& setbind)
 	char key[100];
 	sprintf(key, "bind_port_%d_%s", (bindPort + 1), BindName[bindId]);
 	mtxCoreOptions.Lock();
-	ZL_Application::SettingsSet(key, setbind.ToConfig());
-	if (!ZL_Application::SettingsHas("custom_controller_bindings"))
+	SettingsWriter.Set(key, setbind.ToConfig());
+	if (!SettingsWriter.Has("custom_controller_bindings"))
 	{
-		ZL_Application::SettingsSet("custom_controller_bindings", "true");
+		SettingsWriter.Set("custom_controller_bindings", "true");
 		for (int idx = 0; idx != _BIND_PORTS * _BIND_ID_COUNT; idx++)
 		{
 			int bindPort = (idx / _BIND_ID_COUNT), bindId = (idx % _BIND_ID_COUNT);
 			if (!JoyBinds[bindPort][bindId].Joy) continue;
 			sprintf(key, "bind_port_%d_%s", (bindPort + 1), BindName[bindId]);
-			ZL_Application::SettingsSet(key, JoyBinds[bindPort][bindId].ToConfig());
+			SettingsWriter.Set(key, JoyBinds[bindPort][bindId].ToConfig());
 		}
 	}
 	DirtySettings();
@@ -627,7 +1656,7 @@ static void ApplyFPSLimit(unsigned char newThrottleMode = ThrottleMode, bool unp
 	double rate = av.timing.fps;
 	if (newThrottleMode == RETRO_THROTTLE_SLOW_MOTION) rate *= SlowRate;
 	else if (newThrottleMode == RETRO_THROTTLE_FAST_FORWARD && FastRate && (rate *= FastRate) >= FAST_FPS_LIMIT) rate /= (int)FastRate;
-	ZL_Application::SetFpsLimit((float)rate);
+	ZL_Application::SetFpsLimit(Unthrottled ? 0.0f : (float)rate);
 	if (unpause) ThrottlePaused = false;
 	AudioSkip = true;
 }
@@ -638,13 +1667,17 @@ static std::string GetSavePath()
 	return ((std::string(PathSaves) += '/').append(content_name.empty() ? "DOSBox-pure" : content_name.c_str()).append(".state") += (DBPS_SaveSlotIndex ? (char)('0' + DBPS_SaveSlotIndex) : '\0'));
 }
 
+static std::vector<unsigned char> StateBuffer; // kept between saves and loads to avoid repeated large allocations
+
 static void RunSave()
 {
+	TRACE_SCOPE("RunSave");
 	DoSave = DoLoad = false;
 	enum { RZIP_VERSION = 1, RZIP_COMPRESSION_LEVEL = 6, RZIP_DEFAULT_CHUNK_SIZE = 131072 };
 	size_t sz = retro_serialize_size(), maxdeflate = ZL_Compression::CompressMaxSize(RZIP_DEFAULT_CHUNK_SIZE), deflate_written;
-	unsigned char *buf = (unsigned char*)malloc(16 + sz + 4 + maxdeflate), *mem = buf + 16, *chnk = mem + sz;
-	if (!retro_serialize(mem, sz)) { free(buf); return; }
+	if (StateBuffer.size() < 16 + sz + 4 + maxdeflate) StateBuffer.resize(16 + sz + 4 + maxdeflate);
+	unsigned char *buf = &StateBuffer[0], *mem = buf + 16, *chnk = mem + sz;
+	if (!retro_serialize(mem, sz)) return;
 
 	// Prepend with RASTATE header
 	memcpy(buf, "RASTATE\1MEM ", 12);
@@ -670,17 +1703,19 @@ static void RunSave()
 		chnk[0] = (deflate_written & 0xFF); chnk[1] = ((deflate_written >> 8) & 0xFF); chnk[2] = ((deflate_written >> 16) & 0xFF); chnk[3] = ((deflate_written >> 24) & 0xFF);
 		if (!fwrite(chnk, 4 + deflate_written, 1, f)) goto fail;
 	}
-	if (0) { fail: vecNotify.push_back({ ZL_TextBuffer(fntOSD, "Error while saving state"), 5000, RETRO_LOG_ERROR, ZLTICKS, 0.0f }); }
-	else vecNotify.push_back({ ZL_TextBuffer(fntOSD, "Saved State"), 1000, RETRO_LOG_WARN, ZLTICKS, 0.0f });
+	if (0) { fail: PushNotify("Error while saving state", 5000, RETRO_LOG_ERROR); }
+	else PushNotify("Saved State", 1000, RETRO_LOG_WARN);
 	fclose(f);
 }
 
-static void RunLoad()
+static bool RunLoad(const char* path = NULL)
 {
+	TRACE_SCOPE("RunLoad");
 	DoSave = DoLoad = false;
 	unsigned char* buf = NULL, rzip_header[20], chunk_header[4], *mem;
 	size_t sz;
-	FILE* f = fopen_wrap(GetSavePath().c_str(), "rb");
+	bool res = false;
+	FILE* f = fopen_wrap((path ? std::string(path) : GetSavePath()).c_str(), "rb");
 	if (!f) goto fail;
 	if (fread(rzip_header, sizeof(rzip_header), 1, f) && !memcmp(rzip_header, "#RZIPv\1#", 8))
 	{
@@ -688,7 +1723,8 @@ static void RunLoad()
 		size_t chunk_size = ((size_t)rzip_header[8]) | ((size_t)rzip_header[9] << 8) | ((size_t)rzip_header[10] << 16) | ((size_t)rzip_header[11] << 24), maxdeflate = ZL_Compression::CompressMaxSize(chunk_size), deflate_read, decomp_size;
 		// Get total uncompressed data size - next 8 bytes
 		sz = (size_t)(((Bit64u)rzip_header[12]) | ((Bit64u)rzip_header[13] << 8) | ((Bit64u)rzip_header[14] << 16) | ((Bit64u)rzip_header[15] << 24) | ((Bit64u)rzip_header[16] << 32) | ((Bit64u)rzip_header[17] << 40) | ((Bit64u)rzip_header[18] << 48) | ((Bit64u)rzip_header[19] << 56));
-		buf = (unsigned char*)malloc(sz + maxdeflate);
+		if (StateBuffer.size() < sz + maxdeflate) StateBuffer.resize(sz + maxdeflate);
+		buf = &StateBuffer[0];
 		unsigned char* chnk = buf + sz;
 		for (size_t i = 0; i != sz; i += chunk_size)
 			if (!fread(chunk_header, sizeof(chunk_header), 1, f) || (deflate_read = ((size_t)chunk_header[0]) | ((size_t)chunk_header[1] << 8) | ((size_t)chunk_header[2] << 16) | ((size_t)chunk_header[3] << 24)) == 0
@@ -698,7 +1734,8 @@ static void RunLoad()
 	{
 		fseek(f, 0, SEEK_END);
 		sz = (size_t)ftell(f);
-		buf = (unsigned char*)malloc(sz);
+		if (StateBuffer.size() < sz + 1) StateBuffer.resize(sz + 1);
+		buf = &StateBuffer[0];
 		fseek(f, 0, SEEK_SET);
 		if (!fread(buf, sz, 1, f)) sz = 0;
 	}
@@ -713,10 +1750,10 @@ static void RunLoad()
 			break;
 		}
 	if (!retro_unserialize(mem, sz)) {} // will show error on its own
-	else if (0) { fail: vecNotify.push_back({ ZL_TextBuffer(fntOSD, "Error while loading state"), 5000, RETRO_LOG_ERROR, ZLTICKS, 0.0f }); }
-	else vecNotify.push_back({ ZL_TextBuffer(fntOSD, "Loaded State"), 1000, RETRO_LOG_INFO, ZLTICKS, 0.0f });
+	else if (0) { fail: PushNotify("Error while loading state", 5000, RETRO_LOG_ERROR); }
+	else { PushNotify("Loaded State", 1000, RETRO_LOG_INFO); res = true; }
 	if (f) fclose(f);
-	free(buf);
+	return res;
 }
 
 static retro_proc_address_t RETRO_CALLCONV retro_hw_get_proc_address(const char *sym)
@@ -730,278 +1767,2518 @@ uintptr_t RETRO_CALLCONV retro_hw_get_current_framebuffer(void)
 	return ZL_Surface_GetGLFrameBuffer(&srfCore);
 }
 
-static bool RETRO_CALLCONV retro_environment_cb(unsigned cmd, void *data)
+// Optional GL functions not wrapped by ZillaLib, loaded on first use (NULL if unsupported by the context)
+#if defined(_MSC_VER) || defined(__MINGW32__) || defined(__WIN32__) || defined(WIN32) || defined(_WIN32)
+#define DBP_GLAPI __stdcall
+#else
+#define DBP_GLAPI
+#endif
+static struct SGLExt
 {
-	ZL_ASSERT(MainThreadID == SDL_GetThreadID() || cmd == RETRO_ENVIRONMENT_GET_VFS_INTERFACE || cmd == RETRO_ENVIRONMENT_GET_VARIABLE || cmd == RETRO_ENVIRONMENT_SET_VARIABLE || cmd == RETRO_ENVIRONMENT_GET_SAVE_DIRECTORY || cmd == RETRO_ENVIRONMENT_GET_SYSTEM_DIRECTORY);
-	static bool variables_updated;
-	switch (cmd)
+	enum { TIME_ELAPSED = 0x88BF, QUERY_RESULT = 0x8866, QUERY_RESULT_AVAILABLE = 0x8867, FRAMEBUFFER = 0x8D40, RGBA = 0x1908, UNSIGNED_BYTE = 0x1401,
+		PIXEL_PACK_BUFFER = 0x88EB, STREAM_READ = 0x88E1, MAP_READ_BIT = 0x0001, SYNC_GPU_COMMANDS_COMPLETE = 0x9117, ALREADY_SIGNALED = 0x911A, CONDITION_SATISFIED = 0x911C, WAIT_FAILED = 0x911D };
+	void (DBP_GLAPI *GenQueries)(int n, unsigned* ids);
+	void (DBP_GLAPI *DeleteQueries)(int n, const unsigned* ids);
+	void (DBP_GLAPI *BeginQuery)(unsigned target, unsigned id);
+	void (DBP_GLAPI *EndQuery)(unsigned target);
+	void (DBP_GLAPI *GetQueryObjectuiv)(unsigned id, unsigned pname, unsigned* params);
+	void (DBP_GLAPI *GetQueryObjectui64v)(unsigned id, unsigned pname, Bit64u* params);
+	void (DBP_GLAPI *ReadPixels)(int x, int y, int width, int height, unsigned format, unsigned type, void* pixels);
+	void (DBP_GLAPI *BindFramebuffer)(unsigned target, unsigned framebuffer);
+	void (DBP_GLAPI *GenBuffers)(int n, unsigned* buffers);
+	void (DBP_GLAPI *DeleteBuffers)(int n, const unsigned* buffers);
+	void (DBP_GLAPI *BindBuffer)(unsigned target, unsigned buffer);
+	void (DBP_GLAPI *BufferData)(unsigned target, ptrdiff_t size, const void* data, unsigned usage);
+	void* (DBP_GLAPI *MapBufferRange)(unsigned target, ptrdiff_t offset, ptrdiff_t length, unsigned access);
+	unsigned char (DBP_GLAPI *UnmapBuffer)(unsigned target);
+	void* (DBP_GLAPI *FenceSync)(unsigned condition, unsigned flags);
+	unsigned (DBP_GLAPI *ClientWaitSync)(void* sync, unsigned flags, Bit64u timeout);
+	void (DBP_GLAPI *DeleteSync)(void* sync);
+	bool loaded, haveTimer, havePBO;
+
+	void Load()
 	{
-		case RETRO_ENVIRONMENT_SET_SUPPORT_NO_GAME:
-			return true;
-		case RETRO_ENVIRONMENT_GET_SAVE_DIRECTORY:
-			*((const char **)data) = PathSaves.c_str();
-			return true;
-		case RETRO_ENVIRONMENT_GET_SYSTEM_DIRECTORY:
-			*((const char **)data) = PathSystem.c_str();
-			return true;
-		case RETRO_ENVIRONMENT_GET_LOG_INTERFACE:
-			return false;
-		case RETRO_ENVIRONMENT_SET_KEYBOARD_CALLBACK:
-			retro_keyboard_event_cb = ((struct retro_keyboard_callback*)data)->callback;
-			return true;
-		case RETRO_ENVIRONMENT_SET_CORE_OPTIONS_UPDATE_DISPLAY_CALLBACK:
-			//static retro_core_options_update_display_callback_t update_display_cb;
-			//update_display_cb = ((struct retro_core_options_update_display_callback*)data)->callback;
-			//return true;
-			return false;
-		case RETRO_ENVIRONMENT_SET_DISK_CONTROL_EXT_INTERFACE:
-			//static retro_disk_control_ext_callback disk_control_cb;
-			//disk_control_cb = *((struct retro_disk_control_ext_callback*)data);
-			//return true;
-			return false;
-		case RETRO_ENVIRONMENT_SET_DISK_CONTROL_INTERFACE:
-			return false;
-		case RETRO_ENVIRONMENT_GET_PERF_INTERFACE:
-			//((struct retro_perf_callback*)data)->get_time_usec = retro_perf_get_time_usec;
-			return false;
-		case RETRO_ENVIRONMENT_GET_CORE_OPTIONS_VERSION:
-			*(unsigned*)data = 2;
-			return true;
-		case RETRO_ENVIRONMENT_SET_CORE_OPTIONS_V2:
-			mtxCoreOptions.Lock();
-			for (const retro_core_option_v2_definition *it = ((retro_core_options_v2*)data)->definitions; it->key; it++)
+		if (loaded) return;
+		loaded = true;
+		#ifndef ZL_VIDEO_OPENGL_ES2
+		*(void**)&GenQueries          = SDL_GL_GetProcAddress("glGenQueries");
+		*(void**)&DeleteQueries       = SDL_GL_GetProcAddress("glDeleteQueries");
+		*(void**)&BeginQuery          = SDL_GL_GetProcAddress("glBeginQuery");
+		*(void**)&EndQuery            = SDL_GL_GetProcAddress("glEndQuery");
+		*(void**)&GetQueryObjectuiv   = SDL_GL_GetProcAddress("glGetQueryObjectuiv");
+		*(void**)&GetQueryObjectui64v = SDL_GL_GetProcAddress("glGetQueryObjectui64v");
+		*(void**)&MapBufferRange      = SDL_GL_GetProcAddress("glMapBufferRange");
+		*(void**)&FenceSync           = SDL_GL_GetProcAddress("glFenceSync");
+		*(void**)&ClientWaitSync      = SDL_GL_GetProcAddress("glClientWaitSync");
+		*(void**)&DeleteSync          = SDL_GL_GetProcAddress("glDeleteSync");
+		#endif
+		*(void**)&ReadPixels          = SDL_GL_GetProcAddress("glReadPixels");
+		*(void**)&BindFramebuffer     = SDL_GL_GetProcAddress("glBindFramebuffer");
+		*(void**)&GenBuffers          = SDL_GL_GetProcAddress("glGenBuffers");
+		*(void**)&DeleteBuffers       = SDL_GL_GetProcAddress("glDeleteBuffers");
+		*(void**)&BindBuffer          = SDL_GL_GetProcAddress("glBindBuffer");
+		*(void**)&BufferData          = SDL_GL_GetProcAddress("glBufferData");
+		*(void**)&UnmapBuffer         = SDL_GL_GetProcAddress("glUnmapBuffer");
+		haveTimer = (GenQueries && DeleteQueries && BeginQuery && EndQuery && GetQueryObjectuiv && GetQueryObjectui64v);
+		havePBO = (GenBuffers && DeleteBuffers && BindBuffer && BufferData && MapBufferRange && UnmapBuffer && FenceSync && ClientWaitSync && DeleteSync);
+	}
+} GLExt;
+
+// Video capture and screenshots of the core output. Frames are read back asynchronously through a ring of pixel buffer
+// objects and handed to an encoder thread which writes Y4M video (plus a WAV file with the mixed audio) or PNG files.
+static struct SCapture
+{
+	enum { PBOS = 3, FRAMES = 8, FRAME_REPEAT = 0xFF, FRAME_END = 0xFE, AUDIO_SAMPLES = 44100, MAX_WAIT_TIMEOUTS = 10 };
+	struct SFrame { std::vector<unsigned char> px; int w, h; bool shot, png; std::string name; }; // name is the screenshot path or the recording prefix
+	SFrame frames[FRAMES];
+	SSPSCQueue<unsigned char, FRAMES> queFree;
+	SSPSCQueue<unsigned char, FRAMES * 4> queFull;
+	SSPSCQueue<short, AUDIO_SAMPLES * 2> queAudio;
+	unsigned pbos[PBOS], pboHead, pboTail, waitTimeouts; void* fences[PBOS]; int pboW[PBOS], pboH[PBOS]; bool pboShot[PBOS];
+	std::atomic<bool> active; // recording video and audio
+	bool wantShot, pngSequence;
+	unsigned frameCount, dropped, audioDropped, repeats; // repeats counted but not queued yet
+	std::string baseName, shotName, lastShotName; // path and file name prefix for the current recording or screenshot (main thread)
+	std::thread thread;
+	std::atomic<bool> quit;
+
+	// Encoder thread state
+	FILE *fVideo, *fAudio;
+	int videoW, videoH, videoSegment;
+	unsigned pngIndex, shotIndex, audioBytes;
+	std::string encName; bool encPng; // recording the encoder is writing, taken from the frames it receives
+	std::vector<unsigned char> conv, pack;
+
+	static std::string MakeBaseName()
+	{
+		const std::string& content_name = DBPS_GetContentName();
+		char stamp[32]; time_t t = time(NULL); strftime(stamp, sizeof(stamp), "_%Y%m%d_%H%M%S", localtime(&t));
+		std::string dir = (std::string(PathSaves) += '/').append("capture");
+		retro_vfs_mkdir_impl(dir.c_str());
+		return (dir += '/').append(content_name.empty() ? "DOSBox-pure" : content_name.c_str()).append(stamp);
+	}
+
+	void Start(bool forShot)
+	{
+		GLExt.Load();
+		if (!thread.joinable())
+		{
+			for (unsigned char i = 0; i != FRAMES; i++) queFree.Push(i);
+			if (GLExt.havePBO) GLExt.GenBuffers(PBOS, pbos);
+			quit = false;
+			thread = std::thread(Run, this);
+		}
+		if (forShot) { shotName = MakeShotName(); wantShot = true; return; }
+		pngSequence = ((SettingsWriter.Get("capture_format").c_str()[0]|0x20) == 'p');
+		baseName = MakeBaseName();
+		frameCount = dropped = audioDropped = repeats = 0;
+		active = true;
+		PushNotify("Started recording", 1000, RETRO_LOG_INFO);
+	}
+
+	void Stop()
+	{
+		active = false;
+		while (pboTail != pboHead) Harvest(true); // flush frames still in flight
+		for (FlushRepeats(); repeats; FlushRepeats()) ZL_Thread::Sleep(1);
+		while (!queFull.Push(FRAME_END)) ZL_Thread::Sleep(1);
+		PushNotify(ZL_String::format("Stopped recording (%u frames, %u dropped)", frameCount, dropped).c_str(), 3000, (dropped ? RETRO_LOG_WARN : RETRO_LOG_INFO));
+	}
+
+	void Shutdown()
+	{
+		if (active) Stop();
+		if (!thread.joinable()) return;
+		quit = true;
+		thread.join();
+	}
+
+	void FlushRepeats()
+	{
+		// Keep room in the queue for every frame buffer and the end marker so pushing those never fails
+		while (repeats && queFull.Count() < FRAMES * 3 && queFull.Push(FRAME_REPEAT)) repeats--;
+	}
+
+	void Repeat()
+	{
+		// Encoder is falling behind, repeat the last frame to keep video and audio in sync (queued later if the queue is full)
+		dropped++; frameCount++; repeats++;
+		FlushRepeats();
+	}
+
+	void Submit(const unsigned char* px, int w, int h, bool shot)
+	{
+		unsigned char idx;
+		if (!queFree.Pop(idx))
+		{
+			if (shot) { PushNotify("Error while saving screenshot", 3000, RETRO_LOG_ERROR); return; }
+			Repeat();
+			return;
+		}
+		SFrame& fr = frames[idx];
+		fr.px.resize((size_t)w * h * 4);
+		if (px) memcpy(&fr.px[0], px, fr.px.size());
+		else GLExt.ReadPixels(0, 0, w, h, SGLExt::RGBA, SGLExt::UNSIGNED_BYTE, &fr.px[0]);
+		fr.w = w; fr.h = h; fr.shot = shot; fr.png = pngSequence;
+		fr.name = (shot ? shotName : baseName);
+		if (!shot) { frameCount++; FlushRepeats(); }
+		queFull.Push(idx);
+	}
+
+	void Harvest(bool wait)
+	{
+		while (pboTail != pboHead)
+		{
+			const unsigned slot = pboTail % PBOS;
+			unsigned res = GLExt.ClientWaitSync(fences[slot], (wait ? 1 : 0), (wait ? (Bit64u)100000000 : 0)); // flush commands when waiting
+			const bool ready = (res == SGLExt::ALREADY_SIGNALED || res == SGLExt::CONDITION_SATISFIED);
+			if (!ready && res != SGLExt::WAIT_FAILED && (!wait || ++waitTimeouts < MAX_WAIT_TIMEOUTS)) return;
+			waitTimeouts = 0;
+			GLExt.DeleteSync(fences[slot]);
+			if (!ready)
 			{
-				if (!ZL_Application::SettingsHas(it->key)) continue;
-				ZL_String val = ZL_Application::SettingsGet(it->key);
-				if (val != it->default_value) { for (const retro_core_option_value *v = it->values; v->value; v++) { if (val == v->value) goto keyok; } }
-				static const char* allowlist[] = { "interface_fastrate", "interface_slowrate", "interface_audiolatency",
-					"dosbox_pure_force60fps", "dosbox_pure_menu_transparency", "dosbox_pure_mouse_speed_factor", "dosbox_pure_mouse_speed_factor_x", "dosbox_pure_joystick_analog_deadzone",
-					"dosbox_pure_cycles", "dosbox_pure_cycles_max", "dosbox_pure_cycles_scale", "dosbox_pure_cycle_limit" };
-				for (const char* p : allowlist) { if (!strcmp(it->key, p)) goto keyok; }
-				ZL_Application::SettingsDel(it->key);
-				keyok:;
+				// The fence failed or never signaled (lost or broken context), give up on the frame so stopping doesn't hang
+				if (pboShot[slot]) PushNotify("Error while saving screenshot", 3000, RETRO_LOG_ERROR);
+				else Repeat();
 			}
-			mtxCoreOptions.Unlock();
-			return true;
-		case RETRO_ENVIRONMENT_GET_VARIABLE:
+			else
+			{
+				GLExt.BindBuffer(SGLExt::PIXEL_PACK_BUFFER, pbos[slot]);
+				if (const void* px = GLExt.MapBufferRange(SGLExt::PIXEL_PACK_BUFFER, 0, (ptrdiff_t)pboW[slot] * pboH[slot] * 4, SGLExt::MAP_READ_BIT))
+				{
+					Submit((const unsigned char*)px, pboW[slot], pboH[slot], pboShot[slot]);
+					GLExt.UnmapBuffer(SGLExt::PIXEL_PACK_BUFFER);
+				}
+				GLExt.BindBuffer(SGLExt::PIXEL_PACK_BUFFER, 0);
+			}
+			pboTail++;
+		}
+	}
+
+	void Readback()
+	{
+		const int w = (int)(srfCore.GetWidth() * srfCore.GetScaleW() + .4999f), h = (int)(srfCore.GetHeight() * srfCore.GetScaleH() + .4999f);
+		const bool shot = wantShot;
+		wantShot = false;
+		extern unsigned ZL_Surface_GetGLFrameBuffer(ZL_Surface* srf);
+		GLExt.BindFramebuffer(SGLExt::FRAMEBUFFER, ZL_Surface_GetGLFrameBuffer(&srfCore));
+		if (!GLExt.havePBO) Submit(NULL, w, h, shot); // synchronous fallback
+		else
 		{
-			bool res = true;
-			mtxCoreOptions.Lock();
-			ZL_String val = ZL_Application::SettingsGet(((retro_variable*)data)->key);
-			if (!val.empty())
+			Harvest(false);
+			if (pboHead - pboTail == PBOS) { if (!shot) Repeat(); else wantShot = true; }
+			else
 			{
-				static ZL_Json storage; // to keep the string pointers stable
-				ZL_Json it = storage[((retro_variable*)data)->key];
-				it.SetString(val.c_str());
-				((retro_variable*)data)->value = it.GetString();
+				const unsigned slot = pboHead++ % PBOS;
+				pboW[slot] = w; pboH[slot] = h; pboShot[slot] = shot;
+				GLExt.BindBuffer(SGLExt::PIXEL_PACK_BUFFER, pbos[slot]);
+				GLExt.BufferData(SGLExt::PIXEL_PACK_BUFFER, (ptrdiff_t)w * h * 4, NULL, SGLExt::STREAM_READ);
+				GLExt.ReadPixels(0, 0, w, h, SGLExt::RGBA, SGLExt::UNSIGNED_BYTE, NULL);
+				GLExt.BindBuffer(SGLExt::PIXEL_PACK_BUFFER, 0);
+				fences[slot] = GLExt.FenceSync(SGLExt::SYNC_GPU_COMMANDS_COMPLETE, 0);
 			}
-			else res = false;
-			mtxCoreOptions.Unlock();
-			return res;
 		}
-		case RETRO_ENVIRONMENT_SET_VARIABLE:
+		extern void ZL_GL_ResetFrameBuffer();
+		ZL_GL_ResetFrameBuffer();
+	}
+
+	void PushAudio(const short* buffer, unsigned samples)
+	{
+		if (queAudio.PushMany(buffer, samples * 2) != samples * 2) audioDropped++;
+	}
+
+	static void PutLE(unsigned char* p, unsigned v, int bytes) { for (int i = 0; i != bytes; i++) p[i] = (unsigned char)(v >> (i * 8)); }
+	static void PutBE(unsigned char* p, unsigned v) { p[0] = (unsigned char)(v >> 24); p[1] = (unsigned char)(v >> 16); p[2] = (unsigned char)(v >> 8); p[3] = (unsigned char)v; }
+
+	static unsigned Crc32(const unsigned char* p, size_t n, unsigned crc = 0)
+	{
+		// Used by the encoder and the main thread, the table is built once by the thread-safe static initialization
+		static const struct STable { unsigned t[256]; STable() { for (unsigned i = 0; i != 256; i++) { unsigned c = i; for (int k = 0; k != 8; k++) c = ((c & 1) ? (0xEDB88320 ^ (c >> 1)) : (c >> 1)); t[i] = c; } } } table;
+		crc = ~crc;
+		while (n--) crc = table.t[(crc ^ *(p++)) & 0xFF] ^ (crc >> 8);
+		return ~crc;
+	}
+
+	void WritePNG(const SFrame& fr, const char* path)
+	{
+		// Flip rows (OpenGL is bottom up) and drop the alpha channel
+		const size_t row = (size_t)fr.w * 3 + 1;
+		conv.resize(row * fr.h);
+		for (int y = 0; y != fr.h; y++)
 		{
-			mtxCoreOptions.Lock();
-			if (!((retro_variable*)data)->value) ZL_Application::SettingsDel(((retro_variable*)data)->key);
-			else ZL_Application::SettingsSet(((retro_variable*)data)->key, ((retro_variable*)data)->value);
-			DirtySettings();
-			variables_updated = true;
-			if (((retro_variable*)data)->key[0] == 'i' || !strcmp(((retro_variable*)data)->key, "dosbox_pure_aspect_correction")) DoApplyInterfaceOptions = true;
-			mtxCoreOptions.Unlock();
-			return true;
+			unsigned char* out = &conv[row * y];
+			const unsigned char* in = &fr.px[(size_t)fr.w * 4 * (fr.h - 1 - y)];
+			*(out++) = 0; // filter type none
+			for (int x = 0; x != fr.w; x++, in += 4, out += 3) { out[0] = in[0]; out[1] = in[1]; out[2] = in[2]; }
 		}
-		case RETRO_ENVIRONMENT_GET_VARIABLE_UPDATE:
-			*((bool*)data) = variables_updated;
-			variables_updated = false;
-			return true;
-		case RETRO_ENVIRONMENT_SET_CORE_OPTIONS_DISPLAY:
-			return false;
-		case RETRO_ENVIRONMENT_SET_MEMORY_MAPS:
-			return false;
-		case RETRO_ENVIRONMENT_SET_SUPPORT_ACHIEVEMENTS:
-			return false;
-		case RETRO_ENVIRONMENT_SET_CONTROLLER_INFO:
-			return false;
-		case RETRO_ENVIRONMENT_SET_INPUT_DESCRIPTORS:
-			return false;
-		case RETRO_ENVIRONMENT_GET_VFS_INTERFACE:
+		size_t zlen = ZL_Compression::CompressMaxSize(conv.size());
+		pack.resize(8 + 25 + 12 + zlen + 12);
+		unsigned char *p = &pack[0], *idat = p + 8 + 25;
+		memcpy(p, "\x89PNG\r\n\x1A\n", 8);
+		PutBE(p + 8, 13); memcpy(p + 12, "IHDR", 4); PutBE(p + 16, (unsigned)fr.w); PutBE(p + 20, (unsigned)fr.h);
+		p[24] = 8; p[25] = 2; p[26] = p[27] = p[28] = 0; // 8 bit RGB
+		PutBE(p + 29, Crc32(p + 12, 17));
+		if (!ZL_Compression::Compress(&conv[0], conv.size(), idat + 8, &zlen, 6)) return;
+		PutBE(idat, (unsigned)zlen); memcpy(idat + 4, "IDAT", 4); PutBE(idat + 8 + zlen, Crc32(idat + 4, zlen + 4));
+		unsigned char* iend = idat + 12 + zlen;
+		PutBE(iend, 0); memcpy(iend + 4, "IEND", 4); PutBE(iend + 8, Crc32(iend + 4, 4));
+		FILE* f = fopen_wrap(path, "wb");
+		if (!f) return;
+		fwrite(p, (size_t)(iend + 12 - p), 1, f);
+		fclose(f);
+	}
+
+	void WriteY4M(const SFrame& fr)
+	{
+		if (fVideo && (fr.w != videoW || fr.h != videoH)) { fclose(fVideo); fVideo = NULL; } // video mode changed, start new segment
+		if (!fVideo)
 		{
-			retro_vfs_interface_info* vfs = (retro_vfs_interface_info*)data;
-			static retro_vfs_interface vfs_iface =
+			std::string path(encName);
+			if (videoSegment++) path.append(ZL_String::format("_%d", videoSegment));
+			if (!(fVideo = fopen_wrap(path.append(".y4m").c_str(), "wb"))) return;
+			fprintf(fVideo, "YUV4MPEG2 W%d H%d F%u:1000 Ip A1:1 C444\n", fr.w, fr.h, (unsigned)(av.timing.fps * 1000 + .4999));
+			videoW = fr.w; videoH = fr.h;
+		}
+		// Convert to planar full range BT.601 YCbCr 4:4:4 and flip rows
+		const size_t plane = (size_t)fr.w * fr.h;
+		conv.resize(plane * 3);
+		for (int y = 0; y != fr.h; y++)
+		{
+			const unsigned char* in = &fr.px[(size_t)fr.w * 4 * (fr.h - 1 - y)];
+			unsigned char *Y = &conv[(size_t)fr.w * y], *U = Y + plane, *V = U + plane;
+			for (int x = 0; x != fr.w; x++, in += 4)
 			{
-				NULL, NULL, NULL, NULL, NULL, NULL, NULL, NULL, NULL, NULL, NULL, NULL, NULL,
-				retro_vfs_mkdir_impl,
-				retro_vfs_opendir_impl,
-				retro_vfs_readdir_impl,
-				retro_vfs_dirent_get_name_impl,
-				retro_vfs_dirent_is_dir_impl,
-				retro_vfs_closedir_impl
-			};
-			vfs->iface = &vfs_iface;
-			return true;
+				const int r = in[0], g = in[1], b = in[2];
+				Y[x] = (unsigned char)((  77 * r + 150 * g +  29 * b + 128) >> 8);
+				U[x] = (unsigned char)(( -43 * r -  85 * g + 128 * b + 128 + (128 << 8)) >> 8);
+				V[x] = (unsigned char)(( 128 * r - 107 * g -  21 * b + 128 + (128 << 8)) >> 8);
+			}
 		}
-		case RETRO_ENVIRONMENT_GET_THROTTLE_STATE:
+		fwrite("FRAME\n", 6, 1, fVideo);
+		fwrite(&conv[0], conv.size(), 1, fVideo);
+	}
+
+	void WriteAudio()
+	{
+		if (!fAudio && encName.empty()) return; // wait for the first video frame which tells the name of the recording
+		short buf[4096];
+		for (unsigned n; (n = queAudio.PopMany(buf, 4096)) != 0;)
 		{
-			float corefps = (float)av.timing.fps, vsyncfps = ZL_Application::GetVsyncFps();
-			if (vsyncfps && vsyncfps != corefps)
+			if (!fAudio)
 			{
-				((retro_throttle_state*)data)->mode = RETRO_THROTTLE_VSYNC;
-				((retro_throttle_state*)data)->rate = vsyncfps;
+				if (!(fAudio = fopen_wrap((std::string(encName) += ".wav").c_str(), "wb"))) continue;
+				unsigned char hdr[44];
+				memcpy(hdr, "RIFF\0\0\0\0WAVEfmt ", 16); PutLE(hdr + 16, 16, 4); PutLE(hdr + 20, 1, 2); PutLE(hdr + 22, 2, 2);
+				PutLE(hdr + 24, 44100, 4); PutLE(hdr + 28, 44100 * 4, 4); PutLE(hdr + 32, 4, 2); PutLE(hdr + 34, 16, 2); memcpy(hdr + 36, "data\0\0\0\0", 8);
+				fwrite(hdr, 44, 1, fAudio);
+				audioBytes = 0;
 			}
-			else
+			fwrite(buf, n * 2, 1, fAudio);
+			audioBytes += n * 2;
+		}
+	}
+
+	void EndRecording()
+	{
+		WriteAudio();
+		if (fAudio)
+		{
+			unsigned char sz[4];
+			PutLE(sz, audioBytes + 36, 4); fseek(fAudio, 4, SEEK_SET); fwrite(sz, 4, 1, fAudio);
+			PutLE(sz, audioBytes, 4); fseek(fAudio, 40, SEEK_SET); fwrite(sz, 4, 1, fAudio);
+			fclose(fAudio);
+			fAudio = NULL;
+		}
+		if (fVideo) { fclose(fVideo); fVideo = NULL; }
+		videoSegment = 0; pngIndex = 0;
+		encName.clear();
+	}
+
+	static void Run(SCapture* cp)
+	{
+		SCapture& c = *cp;
+		for (unsigned char idx, last = FRAME_REPEAT;;)
+		{
+			const bool quitting = c.quit, idle = !c.queFull.Count() && !c.queAudio.Count();
+			while (c.queFull.Pop(idx))
 			{
-				((retro_throttle_state*)data)->mode = ThrottleMode;
-				((retro_throttle_state*)data)->rate = corefps * (ThrottleMode == RETRO_THROTTLE_SLOW_MOTION ? SlowRate : ThrottleMode == RETRO_THROTTLE_FAST_FORWARD ? FastRate : ThrottleMode == RETRO_THROTTLE_FRAME_STEPPING ? 0.0f : 1.0f);
+				if (idx == FRAME_END) { c.EndRecording(); if (last != FRAME_REPEAT) c.queFree.Push(last); last = FRAME_REPEAT; continue; }
+				if (idx == FRAME_REPEAT) { if (last != FRAME_REPEAT && !c.encPng) c.WriteY4M(c.frames[last]); continue; }
+				SFrame& fr = c.frames[idx];
+				if (!fr.shot && fr.name != c.encName) { c.encName = fr.name; c.encPng = fr.png; }
+				if (fr.shot) c.WritePNG(fr, (std::string(fr.name) += ".png").c_str());
+				else if (c.encPng) c.WritePNG(fr, (std::string(c.encName) += ZL_String::format("_%06u.png", ++c.pngIndex)).c_str());
+				else c.WriteY4M(fr);
+				if (fr.shot) { c.queFree.Push(idx); continue; }
+				if (last != FRAME_REPEAT) c.queFree.Push(last); // keep the most recent video frame around for repeats
+				last = idx;
 			}
-			return true;
+			if (c.active) c.WriteAudio();
+			if (quitting) { c.EndRecording(); break; }
+			if (idle) ZL_Thread::Sleep(2);
 		}
-		case RETRO_ENVIRONMENT_SET_GEOMETRY:
-			ZL_ASSERT(av.geometry.max_width == ((retro_game_geometry*)data)->max_width && av.geometry.max_height == ((retro_game_geometry*)data)->max_height);
-			av.geometry = *((retro_game_geometry*)data);
-			DoApplyGeometry = true;
-			return true;
-		case RETRO_ENVIRONMENT_SET_SYSTEM_AV_INFO:
-			av = *((retro_system_av_info*)data);
-			ApplyFPSLimit();
-			if (av.geometry.max_width > (unsigned)srfCore.GetWidth() ||av.geometry.max_height > (unsigned)srfCore.GetHeight())
+	}
+
+	std::string MakeShotName()
+	{
+		std::string res = MakeBaseName();
+		if (res != lastShotName) { lastShotName = res; shotIndex = 0; return res; }
+		return res.append(ZL_String::format("_%u", ++shotIndex)); // multiple screenshots in the same second
+	}
+} Capture;
+
+static void OnKeyDown(ZL_KeyboardEvent& e);
+static void OnKeyUp(ZL_KeyboardEvent& e);
+
+// Input-to-photon latency test (--latency-test N) injecting presses of the space key (or joypad B with --latency-input joypad)
+// Each frame a region of the core output is read back asynchronously and the first frame that differs after a press is timed
+static struct SLatencyTest
+{
+	enum { PBOS = 4, HISTORY = 16, SETTLE_FRAMES = 20, TIMEOUT_FRAMES = 120, MAX_TIMEOUTS = 10 };
+	enum EState { SETTLE, WAIT_STABLE, PRESS, WAIT_CHANGE } state;
+	bool active, useJoypad, joypadPressed;
+	unsigned wantSamples, frame, stateFrame, pressFrame, timeouts, stableHash, lastHash;
+	int rx, ry, rw, rh; // region in core output pixels (0 size for the whole output)
+	retro_time_t pressUsec, frameStart[HISTORY];
+	unsigned pbos[PBOS], pboFrame[PBOS], pboHead, pboTail; void* fences[PBOS]; int pboW[PBOS], pboH[PBOS];
+	std::vector<unsigned char> px;
+	std::vector<unsigned> sampleFrames;
+	std::vector<float> sampleMs;
+
+	void Inject(bool down)
+	{
+		if (useJoypad) { joypadPressed = down; return; }
+		ZL_KeyboardEvent e = { ZLK_SPACE, 0, down, false };
+		if (down) OnKeyDown(e); else OnKeyUp(e);
+	}
+
+	void BeginFrame()
+	{
+		frame++;
+		frameStart[frame % HISTORY] = dbp_cpu_features_get_time_usec(); // the previous frame has been presented at this point
+		if (state == SETTLE && frame - stateFrame >= SETTLE_FRAMES) { state = WAIT_STABLE; stateFrame = frame; lastHash = 0; }
+		else if (state == PRESS)
+		{
+			// Injected at the same point where SDL key events get handled, right before the core runs
+			pressUsec = dbp_cpu_features_get_time_usec();
+			pressFrame = frame;
+			Inject(true);
+			state = WAIT_CHANGE;
+		}
+		else if (state == WAIT_CHANGE && frame - pressFrame > TIMEOUT_FRAMES) { Release(); Timeout(); }
+	}
+
+	void Timeout()
+	{
+		// Give up if the content doesn't react (or never gets stable) so unattended runs don't hang
+		if (++timeouts >= MAX_TIMEOUTS) Finish();
+	}
+
+	void Finish()
+	{
+		Report();
+		active = false;
+		ZL_Application::Quit(sampleFrames.size() >= wantSamples ? 0 : 1);
+	}
+
+	void Release()
+	{
+		Inject(false);
+		state = SETTLE;
+		stateFrame = frame;
+	}
+
+	void OnResult(unsigned resFrame, unsigned hash)
+	{
+		if (state == WAIT_STABLE)
+		{
+			// Wait for two equal frames in a row so animations don't get mistaken for the reaction
+			if (hash == lastHash) { stableHash = hash; state = PRESS; }
+			else if (frame - stateFrame > TIMEOUT_FRAMES) { state = SETTLE; stateFrame = frame; Timeout(); }
+			lastHash = hash;
+		}
+		else if (state == WAIT_CHANGE && resFrame >= pressFrame && hash != stableHash)
+		{
+			// The frame counts as visible when the next frame starts after its buffer swap
+			const retro_time_t photon = (resFrame + 1 <= frame ? frameStart[(resFrame + 1) % HISTORY] : dbp_cpu_features_get_time_usec());
+			sampleFrames.push_back(resFrame - pressFrame);
+			sampleMs.push_back((photon - pressUsec) / 1000.0f);
+			Release();
+			if (sampleFrames.size() >= wantSamples) Finish();
+		}
+	}
+
+	void Readback()
+	{
+		int w = (int)(srfCore.GetWidth() * srfCore.GetScaleW() + .4999f), h = (int)(srfCore.GetHeight() * srfCore.GetScaleH() + .4999f), x = 0, y = 0;
+		GLExt.Load(); // not at start, there's no GL context yet when parsing the command line
+		if (rw > 0 && rh > 0) { x = ZL_Math::Min(rx, w - 1); y = ZL_Math::Min(ry, h - 1); w = ZL_Math::Min(rw, w - x); h = ZL_Math::Min(rh, h - y); }
+		extern unsigned ZL_Surface_GetGLFrameBuffer(ZL_Surface* srf);
+		GLExt.BindFramebuffer(SGLExt::FRAMEBUFFER, ZL_Surface_GetGLFrameBuffer(&srfCore));
+		if (!GLExt.havePBO)
+		{
+			px.resize((size_t)w * h * 4);
+			GLExt.ReadPixels(x, y, w, h, SGLExt::RGBA, SGLExt::UNSIGNED_BYTE, &px[0]);
+			OnResult(frame, SCapture::Crc32(&px[0], px.size()));
+		}
+		else
+		{
+			if (!pbos[0]) GLExt.GenBuffers(PBOS, pbos);
+			for (; pboTail != pboHead; pboTail++)
+			{
+				const unsigned slot = pboTail % PBOS;
+				const unsigned res = GLExt.ClientWaitSync(fences[slot], 0, 0);
+				if (res != SGLExt::ALREADY_SIGNALED && res != SGLExt::CONDITION_SATISFIED && pboHead - pboTail != PBOS) break;
+				if (res != SGLExt::ALREADY_SIGNALED && res != SGLExt::CONDITION_SATISFIED) GLExt.ClientWaitSync(fences[slot], 1, (Bit64u)100000000); // all slots in flight
+				GLExt.DeleteSync(fences[slot]);
+				GLExt.BindBuffer(SGLExt::PIXEL_PACK_BUFFER, pbos[slot]);
+				if (const void* mapped = GLExt.MapBufferRange(SGLExt::PIXEL_PACK_BUFFER, 0, (ptrdiff_t)pboW[slot] * pboH[slot] * 4, SGLExt::MAP_READ_BIT))
+				{
+					const unsigned hash = SCapture::Crc32((const unsigned char*)mapped, (size_t)pboW[slot] * pboH[slot] * 4);
+					GLExt.UnmapBuffer(SGLExt::PIXEL_PACK_BUFFER);
+					GLExt.BindBuffer(SGLExt::PIXEL_PACK_BUFFER, 0);
+					OnResult(pboFrame[slot], hash);
+				}
+				else GLExt.BindBuffer(SGLExt::PIXEL_PACK_BUFFER, 0);
+			}
+			const unsigned slot = pboHead++ % PBOS;
+			pboFrame[slot] = frame; pboW[slot] = w; pboH[slot] = h;
+			GLExt.BindFramebuffer(SGLExt::FRAMEBUFFER, ZL_Surface_GetGLFrameBuffer(&srfCore));
+			GLExt.BindBuffer(SGLExt::PIXEL_PACK_BUFFER, pbos[slot]);
+			GLExt.BufferData(SGLExt::PIXEL_PACK_BUFFER, (ptrdiff_t)w * h * 4, NULL, SGLExt::STREAM_READ);
+			GLExt.ReadPixels(x, y, w, h, SGLExt::RGBA, SGLExt::UNSIGNED_BYTE, NULL);
+			GLExt.BindBuffer(SGLExt::PIXEL_PACK_BUFFER, 0);
+			fences[slot] = GLExt.FenceSync(SGLExt::SYNC_GPU_COMMANDS_COMPLETE, 0);
+		}
+		extern void ZL_GL_ResetFrameBuffer();
+		ZL_GL_ResetFrameBuffer();
+	}
+
+	void Start(unsigned samples)
+	{
+		active = true;
+		wantSamples = ZL_Math::Max(samples, 1u);
+		state = SETTLE;
+		stateFrame = frame;
+	}
+
+	void Report()
+	{
+		const size_t n = sampleFrames.size();
+		std::vector<unsigned> f = sampleFrames; std::vector<float> ms = sampleMs;
+		std::sort(f.begin(), f.end()); std::sort(ms.begin(), ms.end());
+		double sumF = 0, sumMs = 0; for (size_t i = 0; i != n; i++) { sumF += f[i]; sumMs += ms[i]; }
+		#define DBP_LAT_PCT(v, p) (n ? (double)v[ZL_Math::Min(n * p / 100, n - 1)] : 0.0)
+		if (n < wantSamples) fprintf(stderr, "Latency test gave up after %u timeouts with %u of %u samples\n", timeouts, (unsigned)n, wantSamples);
+		printf("{\n  \"samples\": %u,\n  \"timeouts\": %u,\n  \"input\": \"%s\",\n  \"core_fps\": %.3f,\n", (unsigned)n, timeouts, (useJoypad ? "joypad" : "keyboard"), av.timing.fps);
+		printf("  \"latency_frames\": { \"mean\": %.3f, \"p50\": %.0f, \"p95\": %.0f, \"max\": %.0f },\n", (n ? sumF / n : 0.0), DBP_LAT_PCT(f, 50), DBP_LAT_PCT(f, 95), DBP_LAT_PCT(f, 100));
+		printf("  \"latency_ms\": { \"mean\": %.3f, \"p50\": %.3f, \"p95\": %.3f, \"max\": %.3f }\n}\n", (n ? sumMs / n : 0.0), DBP_LAT_PCT(ms, 50), DBP_LAT_PCT(ms, 95), DBP_LAT_PCT(ms, 100));
+		fflush(stdout);
+		#undef DBP_LAT_PCT
+	}
+} LatencyTest;
+
+// Performance counters registered by the core through RETRO_ENVIRONMENT_GET_PERF_INTERFACE
+static struct SPerfCounters
+{
+	struct SEntry { retro_perf_counter* c; retro_perf_tick_t lastTotal, lastCalls; float msPerSec, callsPerSec; };
+	std::vector<SEntry> entries;
+	ZL_Mutex mtx;
+	ticks_t lastTick;
+	bool logged; // core requested a dump with perf_log, append the report at exit
+
+	static retro_time_t RETRO_CALLCONV GetTimeUsec() { return dbp_cpu_features_get_time_usec(); }
+	static retro_perf_tick_t RETRO_CALLCONV GetCounter() { return (retro_perf_tick_t)std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now().time_since_epoch()).count(); }
+	static void RETRO_CALLCONV Start(retro_perf_counter* c) { if (c->registered) c->start = GetCounter(); }
+	static void RETRO_CALLCONV Stop(retro_perf_counter* c) { if (c->registered) { c->total += GetCounter() - c->start; c->call_cnt++; } }
+	static void RETRO_CALLCONV Log();
+	static void RETRO_CALLCONV Register(retro_perf_counter* c);
+
+	static uint64_t RETRO_CALLCONV GetCPUFeatures()
+	{
+		uint64_t res = 0;
+		#if (defined(__GNUC__) || defined(__clang__)) && (defined(__i386__) || defined(__x86_64__))
+		__builtin_cpu_init();
+		if (__builtin_cpu_supports("mmx"))    res |= RETRO_SIMD_MMX;
+		if (__builtin_cpu_supports("sse"))    res |= RETRO_SIMD_SSE;
+		if (__builtin_cpu_supports("sse2"))   res |= RETRO_SIMD_SSE2;
+		if (__builtin_cpu_supports("sse3"))   res |= RETRO_SIMD_SSE3;
+		if (__builtin_cpu_supports("ssse3"))  res |= RETRO_SIMD_SSSE3;
+		if (__builtin_cpu_supports("sse4.1")) res |= RETRO_SIMD_SSE4;
+		if (__builtin_cpu_supports("sse4.2")) res |= RETRO_SIMD_SSE42;
+		if (__builtin_cpu_supports("avx"))    res |= RETRO_SIMD_AVX;
+		if (__builtin_cpu_supports("avx2"))   res |= RETRO_SIMD_AVX2;
+		if (__builtin_cpu_supports("popcnt")) res |= RETRO_SIMD_POPCNT;
+		if (__builtin_cpu_supports("cmov"))   res |= RETRO_SIMD_CMOV;
+		#elif defined(_MSC_VER) && (defined(_M_IX86) || defined(_M_X64))
+		int r[4];
+		__cpuid(r, 1);
+		if (r[3] & (1 << 23)) res |= RETRO_SIMD_MMX;
+		if (r[3] & (1 << 25)) res |= RETRO_SIMD_SSE;
+		if (r[3] & (1 << 26)) res |= RETRO_SIMD_SSE2;
+		if (r[3] & (1 << 15)) res |= RETRO_SIMD_CMOV;
+		if (r[2] & (1 <<  0)) res |= RETRO_SIMD_SSE3;
+		if (r[2] & (1 <<  9)) res |= RETRO_SIMD_SSSE3;
+		if (r[2] & (1 << 19)) res |= RETRO_SIMD_SSE4;
+		if (r[2] & (1 << 20)) res |= RETRO_SIMD_SSE42;
+		if (r[2] & (1 << 23)) res |= RETRO_SIMD_POPCNT;
+		if ((r[2] & (1 << 28)) && (r[2] & (1 << 27)) && (_xgetbv(0) & 6) == 6) res |= RETRO_SIMD_AVX; // needs OS support for saving YMM registers
+		__cpuidex(r, 7, 0);
+		if ((res & RETRO_SIMD_AVX) && (r[1] & (1 << 5))) res |= RETRO_SIMD_AVX2;
+		#elif defined(__aarch64__) || defined(_M_ARM64)
+		res |= RETRO_SIMD_NEON | RETRO_SIMD_ASIMD;
+		#elif defined(__ARM_NEON__)
+		res |= RETRO_SIMD_NEON;
+		#endif
+		return res;
+	}
+
+	void Update()
+	{
+		// Refresh the per second rates once a second
+		if (ZLSINCE(lastTick) < 1000) return;
+		const float secs = (lastTick ? ZLSINCE(lastTick) / 1000.0f : 0.0f);
+		lastTick = ZLTICKS;
+		mtx.Lock();
+		for (SEntry& e : entries)
+		{
+			const retro_perf_tick_t total = e.c->total, calls = e.c->call_cnt;
+			e.msPerSec = (secs ? (total - e.lastTotal) / 1000000.0f / secs : 0.0f);
+			e.callsPerSec = (secs ? (calls - e.lastCalls) / secs : 0.0f);
+			e.lastTotal = total; e.lastCalls = calls;
+		}
+		std::sort(entries.begin(), entries.end(), [](const SEntry& a, const SEntry& b) { return a.msPerSec > b.msPerSec; });
+		mtx.Unlock();
+	}
+
+	void Draw()
+	{
+		Update();
+		mtx.Lock();
+		const float w = 560, x0 = ZLFROMW(w + 20), y1 = ZLFROMH(20);
+		const size_t n = ZL_Math::Min(entries.size(), (size_t)24);
+		ZL_Display::FillRect(x0 - 10, y1 + 10, x0 + w + 10, y1 - 30 * (n + 1) - 10, ZLLUMA(0, .6));
+		fntOSD.Draw(x0, y1, (entries.empty() ? "No performance counters registered by the core" : "Counter                  ms/sec     calls/sec    us/call"), ZLLUMA(1, .85), ZL_Origin::TopLeft);
+		char buf[64]; float y = y1;
+		for (size_t i = 0; i != n; i++)
+		{
+			const SEntry& e = entries[i];
+			y -= 30;
+			fntOSD.Draw(x0, y, e.c->ident, ZLLUMA(1, .85), ZL_Origin::TopLeft);
+			snprintf(buf, sizeof(buf), "%.2f", e.msPerSec);
+			fntOSD.Draw(x0 + 330, y, buf, ZLLUMA(1, .85), ZL_Origin::TopRight);
+			snprintf(buf, sizeof(buf), "%.0f", e.callsPerSec);
+			fntOSD.Draw(x0 + 460, y, buf, ZLLUMA(1, .85), ZL_Origin::TopRight);
+			snprintf(buf, sizeof(buf), "%.2f", (e.callsPerSec ? e.msPerSec * 1000.0f / e.callsPerSec : 0.0f));
+			fntOSD.Draw(x0 + w, y, buf, ZLLUMA(1, .85), ZL_Origin::TopRight);
+		}
+		mtx.Unlock();
+	}
+
+	void Dump(bool append)
+	{
+		mtx.Lock();
+		if (entries.empty()) { mtx.Unlock(); return; }
+		FILE* f = fopen_wrap((std::string(PathSaves) += '/').append("perf_counters.txt").c_str(), (append ? "ab" : "wb"));
+		if (f)
+		{
+			char stamp[32]; time_t t = time(NULL); strftime(stamp, sizeof(stamp), "%Y-%m-%d %H:%M:%S", localtime(&t));
+			fprintf(f, "[%s] %s\n%-32s %16s %14s %12s\n", stamp, DBPS_GetContentName().c_str(), "Counter", "Total ms", "Calls", "us/call");
+			for (const SEntry& e : entries)
+				fprintf(f, "%-32s %16.3f %14llu %12.3f\n", e.c->ident, e.c->total / 1000000.0, (unsigned long long)e.c->call_cnt, (e.c->call_cnt ? e.c->total / 1000.0 / e.c->call_cnt : 0.0));
+			fputc('\n', f);
+			fclose(f);
+		}
+		mtx.Unlock();
+	}
+} PerfCounters;
+
+void RETRO_CALLCONV SPerfCounters::Log() { PerfCounters.Dump(PerfCounters.logged); PerfCounters.logged = true; }
+void RETRO_CALLCONV SPerfCounters::Register(retro_perf_counter* c)
+{
+	PerfCounters.mtx.Lock();
+	if (!c->registered) { c->registered = true; PerfCounters.entries.push_back({ c, 0, 0, 0.0f, 0.0f }); }
+	PerfCounters.mtx.Unlock();
+}
+
+static bool VariablesUpdated; // reported to the core with RETRO_ENVIRONMENT_GET_VARIABLE_UPDATE
+
+// Core option values for RETRO_ENVIRONMENT_GET_VARIABLE in an immutable hash table that readers on any thread use without locking
+// Writers (holding mtxCoreOptions) publish a new version and free old ones once no reader is inside. Keys are interned, values are
+// reference counted by the versions using them and kept around for a while after the last release so the core can finish using them
+static struct SOptionStore
+{
+	enum { READER_SLOTS = 16, GRAVEYARD = 64 };
+	struct SValue { unsigned refs; char text[1]; };
+	struct SEntry { unsigned hash; const char* key; SValue* value; }; // value is NULL if the option is not set
+	struct SSnapshot { unsigned version; std::vector<SEntry> table; };
+	struct alignas(64) SReaders { std::atomic<int> n; }; // one cache line per slot so reader threads don't contend
+	std::atomic<SSnapshot*> current;
+	SReaders readers[READER_SLOTS];
+	std::vector<SSnapshot*> retired;
+	std::vector<const char*> keys; // interned keys, never freed (bounded by the number of option names)
+	std::vector<SValue*> graveyard; // released values, freed in order once there are too many
+	std::vector<std::pair<const char*, std::string> > overrides; // forced values, from the command line first and then from the cycle governor
+	size_t fixedOverrides;
+
+	static unsigned Hash(const char* s) { unsigned h = 2166136261u; for (; *s; s++) h = (h ^ (unsigned char)*s) * 16777619u; return h; }
+
+	const char* Intern(const char* key)
+	{
+		for (const char* p : keys) if (!strcmp(p, key)) return p;
+		char* p = (char*)malloc(strlen(key) + 1);
+		strcpy(p, key);
+		keys.push_back(p);
+		return p;
+	}
+
+	static SReaders& ReaderSlot(SOptionStore* self)
+	{
+		static std::atomic<unsigned> nextSlot;
+		static thread_local unsigned slot = (nextSlot.fetch_add(1) % READER_SLOTS);
+		return self->readers[slot];
+	}
+
+	bool Get(const char* key, const char*& outValue)
+	{
+		// Returns false if the key isn't in the current version yet
+		SReaders& r = ReaderSlot(this);
+		r.n.fetch_add(1);
+		const SSnapshot* snap = current.load();
+		bool found = false;
+		if (snap)
+		{
+			const unsigned h = Hash(key), mask = (unsigned)snap->table.size() - 1;
+			for (unsigned i = h & mask; snap->table[i].key; i = (i + 1) & mask)
+				if (snap->table[i].hash == h && !strcmp(snap->table[i].key, key)) { outValue = (snap->table[i].value ? snap->table[i].value->text : NULL); found = true; break; }
+		}
+		r.n.fetch_sub(1);
+		return found;
+	}
+
+	ZL_String Configured(const char* key)
+	{
+		// Value from the command line or the settings, ignoring overrides of the cycle governor (call with mtxCoreOptions locked)
+		key = Intern(key);
+		for (size_t i = 0; i != fixedOverrides; i++) if (overrides[i].first == key) return overrides[i].second;
+		return SettingsWriter.Get(key);
+	}
+
+	SValue* Resolve(const char* key, SValue* old)
+	{
+		// Returns the old value with an added reference if it didn't change
+		const char* val = NULL;
+		ZL_String setting;
+		for (const std::pair<const char*, std::string>& o : overrides) if (o.first == key) { val = o.second.c_str(); break; }
+		if (!val && !(setting = SettingsWriter.Get(key)).empty()) val = setting.c_str();
+		if (!val) return NULL;
+		if (old && !strcmp(old->text, val)) { old->refs++; return old; }
+		SValue* v = (SValue*)malloc(sizeof(SValue) + strlen(val));
+		v->refs = 1;
+		strcpy(v->text, val);
+		return v;
+	}
+
+	void Release(SValue* v)
+	{
+		if (!v || --v->refs) return;
+		graveyard.push_back(v);
+		if (graveyard.size() > GRAVEYARD) { free(graveyard.front()); graveyard.erase(graveyard.begin()); }
+	}
+
+	void Publish(const char* changedKey = NULL)
+	{
+		// Copies the previous version and resolves only the changed key (or everything without a key), the table is kept at most half full
+		SSnapshot* old = current.load();
+		if (changedKey) changedKey = Intern(changedKey);
+		size_t count = (changedKey ? 1 : 0);
+		if (old) for (const SEntry& e : old->table) if (e.key && e.key != changedKey) count++;
+		size_t size = 64;
+		while (size < count * 2) size *= 2;
+		SSnapshot* snap = new SSnapshot;
+		snap->version = (old ? old->version + 1 : 1);
+		snap->table.resize(size);
+		bool haveChanged = false;
+		if (old)
+			for (const SEntry& e : old->table)
+			{
+				if (!e.key) continue;
+				SValue* v;
+				if (!changedKey || e.key == changedKey) { v = Resolve(e.key, e.value); haveChanged |= (e.key == changedKey); }
+				else if ((v = e.value) != NULL) v->refs++;
+				Insert(snap, e.key, v);
+			}
+		if (changedKey && !haveChanged) Insert(snap, changedKey, Resolve(changedKey, NULL));
+		current.store(snap);
+		if (old) retired.push_back(old);
+		for (const SReaders& r : readers) if (r.n.load()) return; // every reader after the store sees the new version
+		for (SSnapshot* r : retired) { for (const SEntry& e : r->table) if (e.key) Release(e.value); delete r; }
+		retired.clear();
+	}
+
+	static void Insert(SSnapshot* snap, const char* key, SValue* value)
+	{
+		const unsigned h = Hash(key), mask = (unsigned)snap->table.size() - 1;
+		unsigned i = h & mask;
+		while (snap->table[i].key) i = (i + 1) & mask;
+		snap->table[i] = { h, key, value };
+	}
+
+	void SetOverride(const char* key, const char* value, bool fromCommandLine = false)
+	{
+		key = Intern(key);
+		std::vector<std::pair<const char*, std::string> >::iterator it = overrides.begin() + (fromCommandLine ? 0 : fixedOverrides), itEnd = (fromCommandLine ? overrides.begin() + fixedOverrides : overrides.end());
+		while (it != itEnd && it->first != key) ++it;
+		if (it != itEnd) { if (value) it->second = value; else overrides.erase(it); }
+		else if (value) { overrides.insert(itEnd, std::make_pair(key, std::string(value))); if (fromCommandLine) fixedOverrides++; }
+		Publish(key);
+	}
+} OptionStore;
+
+// Interface and frontend settings parsed once into typed and validated values whenever their text changes
+// ApplyInterfaceOptions gets the groups of the settings that changed and only applies those
+static struct SInterfaceSettings
+{
+	enum EGroup { HOTKEYS = 1, SPEED = 2, AUDIO = 4, POINTER = 8, SHADER = 16, GEOMETRY = 32, POSTCHAIN = 64, TOOLS = 128, ALL = 255 };
+	enum EType : unsigned char { BOOL, INT, FLOAT, CHAR, TEXT, AUTOFLOAT }; // AUTOFLOAT is 'auto' or a number
+	enum EId
+	{
+		HOTKEYMOD, SPEEDTOGGLE, SYSTEMHOTKEYS, MIDDLEMOUSE, FASTRATE, SLOWRATE, AUDIOLATENCY, LOCKMOUSE, SCALING, CRTFILTER, CRTSCANLINE, CRTBLUR, CRTMASK, CRTCURVATURE, CRTCORNER,
+		ASPECTCORRECTION, SHADERCHAIN, SHADERCHAINTIMING, CYCLEGOVERNOR, INPUTTHREAD, SLOWFRAMECAPTURE, SLOWFRAMEHISTORY, FRAMEDELAY,
+		_NUM_INTERFACE_SETTINGS,
+		FORCE60FPS = _NUM_INTERFACE_SETTINGS, MENUTRANSPARENCY, MOUSESPEED, MOUSESPEEDX, ANALOGDEADZONE, CYCLES, CYCLESMAX, CYCLESSCALE, CYCLELIMIT, // core options only listed for their flag
+		_NUM_SETTINGS
+	};
+	struct SDef { const char* key; EType type; unsigned groups; float def, minVal, maxVal; bool freeForm; }; // free-form values other than the listed core option values are kept
+	struct SValue { ZL_String text; float num; bool read, automatic; };
+	SValue values[_NUM_INTERFACE_SETTINGS];
+	unsigned pending; // groups to apply even without a changed setting
+	unsigned stale; // settings to read again on the next refresh (bit per id, at most 32 interface settings)
+
+	static const SDef& Def(int id)
+	{
+		static const SDef defs[_NUM_SETTINGS] =
+		{
+			{ "interface_hotkeymod",                  INT,   HOTKEYS,                1,    0,     31, false },
+			{ "interface_speedtoggle",                CHAR,  HOTKEYS,                0,    0,      0, false },
+			{ "interface_systemhotkeys",              BOOL,  HOTKEYS,                1,    0,      1, false },
+			{ "interface_middlemouse",                BOOL,  HOTKEYS,                0,    0,      1, false },
+			{ "interface_fastrate",                   FLOAT, SPEED,                  5, 1.001f, 1000, true  },
+			{ "interface_slowrate",                   FLOAT, SPEED,               0.3f,    0, 0.999f, true  },
+			{ "interface_audiolatency",               INT,   AUDIO,                 25,    5,   1000, true  },
+			{ "interface_lockmouse",                  BOOL,  POINTER,                0,    0,      1, false },
+			{ "interface_scaling",                    CHAR,  SHADER|GEOMETRY,        0,    0,      0, false },
+			{ "interface_crtfilter",                  INT,   SHADER|GEOMETRY,        0,    0,      5, false },
+			{ "interface_crtscanline",                INT,   SHADER,                 1,    0,      8, false },
+			{ "interface_crtblur",                    INT,   SHADER,                 2,    0,      8, false },
+			{ "interface_crtmask",                    INT,   SHADER,                 2,    0,      4, false },
+			{ "interface_crtcurvature",               INT,   SHADER,                 2,    0,      8, false },
+			{ "interface_crtcorner",                  INT,   SHADER,                 2,    0,      8, false },
+			{ "dosbox_pure_aspect_correction",        TEXT,  GEOMETRY,               0,    0,      0, false },
+			{ "shader_chain",                         TEXT,  POSTCHAIN|GEOMETRY,     0,    0,      0, false },
+			{ "shader_chain_timing",                  BOOL,  POSTCHAIN,              0,    0,      1, false },
+			{ "cycle_governor",                       BOOL,  TOOLS,                  0,    0,      1, false },
+			{ "input_thread",                         BOOL,  TOOLS,                  0,    0,      1, false },
+			{ "slowframe_capture",                    FLOAT, TOOLS,                  0,    0,   1000, false },
+			{ "slowframe_history",                    INT,   TOOLS,                120,    1, 100000, false },
+			{ "frame_delay",                      AUTOFLOAT, TOOLS,                  0,    0,     50, false },
+			{ "dosbox_pure_force60fps",               TEXT,  0,                      0,    0,      0, true  },
+			{ "dosbox_pure_menu_transparency",        TEXT,  0,                      0,    0,      0, true  },
+			{ "dosbox_pure_mouse_speed_factor",       TEXT,  0,                      0,    0,      0, true  },
+			{ "dosbox_pure_mouse_speed_factor_x",     TEXT,  0,                      0,    0,      0, true  },
+			{ "dosbox_pure_joystick_analog_deadzone", TEXT,  0,                      0,    0,      0, true  },
+			{ "dosbox_pure_cycles",                   TEXT,  0,                      0,    0,      0, true  },
+			{ "dosbox_pure_cycles_max",               TEXT,  0,                      0,    0,      0, true  },
+			{ "dosbox_pure_cycles_scale",             TEXT,  0,                      0,    0,      0, true  },
+			{ "dosbox_pure_cycle_limit",              TEXT,  0,                      0,    0,      0, true  },
+		};
+		return defs[id];
+	}
+
+	static int Find(const char* key, bool withCoreOptions = false)
+	{
+		for (int id = 0, idMax = (withCoreOptions ? _NUM_SETTINGS : _NUM_INTERFACE_SETTINGS); id != idMax; id++) if (!strcmp(Def(id).key, key)) return id;
+		return -1;
+	}
+
+	static bool IsFreeForm(const char* key)
+	{
+		// Settings which can have values other than the ones listed in the core options (like set in the config file)
+		const int id = Find(key, true);
+		return (id >= 0 && Def(id).freeForm);
+	}
+
+	unsigned Refresh()
+	{
+		// Called with mtxCoreOptions held, returns the groups that need to be applied
+		// Only settings marked stale (changed through SET_VARIABLE) or never read before are looked up
+		unsigned changed = pending;
+		pending = 0;
+		for (int id = 0; id != _NUM_INTERFACE_SETTINGS; id++)
+		{
+			SValue& v = values[id];
+			if (v.read && !(stale & (1u << id))) continue;
+			const SDef& d = Def(id);
+			ZL_String text = SettingsWriter.Get(d.key);
+			if (v.read && text == v.text) continue;
+			const char c = text.c_str()[0];
+			const bool automatic = (d.type == AUTOFLOAT && (c|0x20) == 'a');
+			float num;
+			switch (d.type)
+			{
+				case BOOL:  num = (c ? (float)((c|0x20) == 't') : d.def); break;
+				case INT:   num = (c ? (float)ZL_Math::Clamp(atoi(text.c_str()), (int)d.minVal, (int)d.maxVal) : d.def); break;
+				case FLOAT: case AUTOFLOAT: num = (c && !automatic ? ZL_Math::Clamp((float)atof(text.c_str()), d.minVal, d.maxVal) : d.def); break;
+				case CHAR:  num = (float)c; break;
+				default:    num = 0; break;
+			}
+			if (!v.read || num != v.num || automatic != v.automatic || d.type == TEXT) changed |= d.groups;
+			v.text = text;
+			v.num = num;
+			v.automatic = automatic;
+			v.read = true;
+		}
+		stale = 0;
+		return changed;
+	}
+
+	bool Bool(EId id) const { return values[id].num != 0; }
+	int Int(EId id) const { return (int)values[id].num; }
+	float Float(EId id) const { return values[id].num; }
+	bool Auto(EId id) const { return values[id].automatic; }
+	char Char(EId id) const { return (char)values[id].num; }
+	const ZL_String& Text(EId id) const { return values[id].text; }
+} InterfaceSettings;
+
+// Adjusts dosbox_pure_cycles so the emulation of a frame fits into the frame time on the host
+// The learned value is served to the core through RETRO_ENVIRONMENT_GET_VARIABLE and stored per content in the saves directory
+static struct SCycleGovernor
+{
+	enum { WINDOW = 120, MIN_CYCLES = 1000 };
+	bool enabled;
+	int cycles, ceiling; // cycles currently forced (0 if not governing) and the configured speed it will raise back up to (0 if unknown)
+	unsigned frames, overBudget, calmWindows, cooldown;
+	retro_time_t runUsec, frameRunUsec; // sum over the current window and over the retro_run calls of the current frame
+
+	std::string GetPath()
+	{
+		const std::string& content_name = DBPS_GetContentName();
+		return (std::string(PathSaves) += '/').append(content_name.empty() ? "DOSBox-pure" : content_name.c_str()).append(".cycles");
+	}
+
+	void SetCycles(int newCycles, bool store = true)
+	{
+		mtxCoreOptions.Lock();
+		cycles = newCycles;
+		OptionStore.SetOverride("dosbox_pure_cycles", (cycles ? ZL_String::format("%d", cycles).c_str() : NULL));
+		VariablesUpdated = true;
+		mtxCoreOptions.Unlock();
+		if (!store || ReadOnlySettings) return;
+		// The learned speed is stored with the configured speed it was lowered from, written by the settings writer thread
+		SettingsWriter.QueueFile(GetPath(), (cycles ? std::string(ZL_String::format("%d %d\n", cycles, ceiling).c_str()) : std::string()));
+	}
+
+	void OnContentLoad()
+	{
+		frames = overBudget = calmWindows = cooldown = 0; runUsec = frameRunUsec = 0;
+		int learned = 0, learnedCeiling = 0;
+		if (enabled)
+			if (FILE* f = fopen_wrap(GetPath().c_str(), "rb")) { if (fscanf(f, "%d %d", &learned, &learnedCeiling) < 1) learned = 0; fclose(f); }
+
+		// A numeric dosbox_pure_cycles is the ceiling, otherwise (auto/max) use the speed measured before it was first lowered
+		mtxCoreOptions.Lock();
+		const int configuredCycles = atoi(OptionStore.Configured("dosbox_pure_cycles").c_str());
+		mtxCoreOptions.Unlock();
+		ceiling = (configuredCycles >= MIN_CYCLES ? configuredCycles : learnedCeiling);
+		if (!ceiling || learned >= ceiling) learned = 0; // can't raise back without knowing the configured speed
+		if (learned != cycles) SetCycles(learned >= MIN_CYCLES ? learned : 0, false);
+	}
+
+	void Enable(bool enable)
+	{
+		if (enable == enabled) return;
+		enabled = enable;
+		if (enabled) OnContentLoad();
+		else if (cycles) { SetCycles(0, false); ceiling = 0; } // keep the learned speed for when it gets enabled again
+	}
+
+	void Frame()
+	{
+		// Only judge regular speed frames of a running game
+		const retro_time_t frameRunUsec = this->frameRunUsec;
+		this->frameRunUsec = 0;
+		if (!enabled || ThrottleMode != RETRO_THROTTLE_NONE || DBPS_IsShowingOSD() || !DBPS_IsGameRunning() || !av.timing.fps) { frames = overBudget = 0; runUsec = 0; return; }
+		const retro_time_t budget = (retro_time_t)(1000000.0 / av.timing.fps);
+		runUsec += frameRunUsec;
+		if (frameRunUsec > budget) overBudget++;
+		if (++frames != WINDOW) return;
+
+		const float load = (float)runUsec / (float)(budget * WINDOW);
+		const bool slow = (load > 0.9f || overBudget > WINDOW / 10);
+		frames = overBudget = 0; runUsec = 0;
+		if (cooldown) { cooldown--; return; } // let the core settle after a change
+
+		extern Bit32s CPU_CycleMax;
+		const int cur = (cycles ? cycles : (int)CPU_CycleMax);
+		if (!cycles) ceiling = cur; // not governing, this is the configured speed
+		if (slow)
+		{
+			// Aim for 80% of the frame budget, reduce by at most half at once
+			int newCycles = ZL_Math::Max((int)(cur * ZL_Math::Max(0.8f / load, 0.5f)) / 100 * 100, (int)MIN_CYCLES);
+			if (newCycles < cur) { SetCycles(newCycles); cooldown = 2; }
+			calmWindows = 0;
+		}
+		else if (load < 0.6f && cycles && cur < ceiling)
+		{
+			// Only raise after several calm windows in a row and in small steps (hysteresis between 60% and 90% load)
+			if (++calmWindows < 3) return;
+			int newCycles = (int)(cur * 1.1f) / 100 * 100;
+			SetCycles(newCycles < ceiling ? newCycles : 0); // back at the configured speed, stop governing
+			calmWindows = 0; cooldown = 1;
+		}
+		else calmWindows = 0;
+	}
+} Governor;
+
+// When a single retro_run call takes longer than slowframe_capture times the frame budget, the state from slowframe_history
+// frames earlier and all input since then are written to the slowframes directory so the scene can be replayed under a profiler
+static struct SSlowFrames
+{
+	struct SInput { Bit32u frame; Bit8u port, device, index, down; Bit16u id; int16_t value; }; // down is 0/1 for keyboard events, 2 for input state changes
+	bool active;
+	float multiple;
+	unsigned history, frame, cooldownUntil, cur;
+	std::vector<unsigned char> snap[2]; // alternating snapshots taken every history frames
+	unsigned snapFrame[2];
+	std::vector<SInput> snapValues[2], inputs, values; // input state at the time of a snapshot, recorded input and current input state
+	std::vector<Bit32u> runUsec; // retro_run time of every frame since the older snapshot
+
+	void Enable(float newMultiple, unsigned newHistory)
+	{
+		if (newMultiple == multiple && newHistory == history) return;
+		active = (newMultiple > 1.0f && newHistory);
+		multiple = newMultiple;
+		history = newHistory;
+		frame = cooldownUntil = cur = 0;
+		for (int i = 0; i != 2; i++) { std::vector<unsigned char>().swap(snap[i]); snapValues[i].clear(); }
+		inputs.clear(); values.clear(); runUsec.clear();
+	}
+
+	void BeforeRun()
+	{
+		if (frame % history) return;
+		TRACE_SCOPE("SlowFrames Snapshot");
+		const size_t sz = retro_serialize_size();
+		snap[cur].resize(16 + sz);
+		memcpy(&snap[cur][0], "RASTATE\1MEM ", 12);
+		for (int i = 0; i != 4; i++) snap[cur][12 + i] = (unsigned char)(sz >> (i * 8));
+		if (!retro_serialize(&snap[cur][16], sz)) { snap[cur].clear(); }
+		snapFrame[cur] = frame;
+		snapValues[cur] = values;
+		cur ^= 1;
+
+		// Drop everything older than the snapshot that is kept
+		const unsigned keepFrom = (snap[cur].empty() ? snapFrame[cur ^ 1] : snapFrame[cur]);
+		size_t n = 0;
+		while (n != inputs.size() && inputs[n].frame < keepFrom) n++;
+		inputs.erase(inputs.begin(), inputs.begin() + n);
+		if (runUsec.size() > frame - keepFrom) runUsec.erase(runUsec.begin(), runUsec.end() - (frame - keepFrom));
+	}
+
+	void RecordKey(bool down, unsigned keycode, unsigned mod)
+	{
+		inputs.push_back({ frame, 0, RETRO_DEVICE_KEYBOARD, 0, (Bit8u)down, (Bit16u)keycode, (int16_t)mod });
+	}
+
+	void RecordInput(unsigned port, unsigned device, unsigned index, unsigned id, int16_t value)
+	{
+		// Only changes are recorded, replaying returns the last recorded value for a query
+		for (SInput& v : values)
+			if (v.port == port && v.device == device && v.index == index && v.id == id)
+			{
+				if (v.value != value) { v.value = value; inputs.push_back({ frame, (Bit8u)port, (Bit8u)device, (Bit8u)index, 2, (Bit16u)id, value }); }
+				return;
+			}
+		values.push_back({ 0, (Bit8u)port, (Bit8u)device, (Bit8u)index, 2, (Bit16u)id, value });
+		inputs.push_back(values.back());
+		inputs.back().frame = frame;
+	}
+
+	void AfterRun(retro_time_t usec)
+	{
+		runUsec.push_back((Bit32u)usec);
+		const float budget = (av.timing.fps ? (float)(1000000.0 / av.timing.fps) : 16667.0f);
+		const int older = (snap[cur].empty() ? (cur ^ 1) : cur);
+		if (usec > budget * multiple && frame >= cooldownUntil && ThrottleMode == RETRO_THROTTLE_NONE && !snap[older].empty() && frame - snapFrame[older] >= history)
+		{
+			Write(older, usec, budget);
+			cooldownUntil = frame + history; // don't write a capture for every frame of a longer stall
+		}
+		frame++;
+	}
+
+	void Write(int idx, retro_time_t usec, float budget)
+	{
+		TRACE_SCOPE("SlowFrames Write");
+		const std::string& content_name = DBPS_GetContentName();
+		std::string path = (std::string(PathSaves) += '/').append("slowframes");
+		retro_vfs_mkdir_impl(path.c_str());
+		path.append("/").append(content_name.empty() ? "DOSBox-pure" : content_name.c_str()).append(ZL_String::format("_%u", frame));
+
+		FILE* f = fopen_wrap((path + ".state").c_str(), "wb");
+		if (!f) return;
+		fwrite(&snap[idx][0], snap[idx].size(), 1, f);
+		fclose(f);
+
+		// Text format: "<frame> K <down> <retrok> <mod>" for keyboard events and "<frame> I <port> <device> <index> <id> <value>" for input state changes
+		if ((f = fopen_wrap((path + ".input").c_str(), "wb")) != NULL)
+		{
+			for (const SInput& v : snapValues[idx]) fprintf(f, "0 I %u %u %u %u %d\n", v.port, v.device, v.index, v.id, v.value);
+			for (const SInput& i : inputs)
+			{
+				if (i.frame < snapFrame[idx]) continue;
+				if (i.down == 2) fprintf(f, "%u I %u %u %u %u %d\n", i.frame - snapFrame[idx], i.port, i.device, i.index, i.id, i.value);
+				else fprintf(f, "%u K %u %u %u\n", i.frame - snapFrame[idx], i.down, i.id, (unsigned)(Bit16u)i.value);
+			}
+			fclose(f);
+		}
+
+		if ((f = fopen_wrap((path + ".txt").c_str(), "wb")) != NULL)
+		{
+			fprintf(f, "Slow frame %u (%u frames after the state) took %.3f ms with a budget of %.3f ms\n", frame, frame - snapFrame[idx], usec / 1000.0, budget / 1000.0);
+			fprintf(f, "\nretro_run time in ms of every frame since the state:\n");
+			for (size_t i = (runUsec.size() > frame - snapFrame[idx] + 1 ? runUsec.size() - (frame - snapFrame[idx] + 1) : 0), n = 0; i != runUsec.size(); i++, n++)
+				fprintf(f, "%u %.3f\n", (unsigned)n, runUsec[i] / 1000.0);
+			fclose(f);
+		}
+		PushNotify(ZL_String::format("Captured slow frame (%.1f ms)", usec / 1000.0).c_str(), 2000, RETRO_LOG_WARN);
+	}
+} SlowFrames;
+
+// Input movie (--record-movie/--play-movie FILE) of all input reaching the core, anchored to a save state stored next to it
+// Uses the line format of slow frame captures with the frame stored as the difference to the previous line (and T, L and E lines)
+static struct SInputMovie
+{
+	enum EMode { OFF, RECORD, PLAY };
+	struct SValue { Bit8u port, device, index; Bit16u id; int16_t value; };
+	EMode mode;
+	bool started, relative;
+	std::string path;
+	FILE* f;
+	unsigned frame, lastFrame, loads, nextFrame;
+	unsigned char throttle;
+	char nextType, nextLine[128]; // line read ahead while playing
+	std::vector<SValue> values; // last recorded or replayed value of every queried input
+
+	bool Recording() const { return mode == RECORD && started; }
+	bool Playing() const { return mode == PLAY && started; }
+
+	std::string StatePath(unsigned load) const
+	{
+		const size_t dot = path.find_last_of('.'), slash = path.find_last_of("/\\");
+		std::string res(path, 0, (dot != std::string::npos && (slash == std::string::npos || dot > slash) ? dot : path.size()));
+		if (load) res.append(ZL_String::format(".%u", load));
+		return res.append(".state");
+	}
+
+	void Start()
+	{
+		// Called after the first frame which started up the emulation, like the benchmark mode
+		started = true;
+		frame = lastFrame = loads = nextFrame = 0;
+		throttle = ThrottleMode;
+		if (mode == RECORD)
+		{
+			if (!WriteState(StatePath(0).c_str()) || (f = fopen_wrap(path.c_str(), "wb")) == NULL) { Fail("Could not write input movie"); return; }
+			fprintf(f, "DOSBoxPure input movie 1\n");
+			PushNotify("Recording input movie", 1000, RETRO_LOG_INFO);
+		}
+		else
+		{
+			if (!(f = fopen_wrap(path.c_str(), "rb")) || !RunLoad(StatePath(0).c_str())) { Fail("Could not load input movie"); return; }
+			// Without the header line the file is the .input file of a slow frame capture with absolute frame numbers
+			relative = (fgets(nextLine, sizeof(nextLine), f) && !strncmp(nextLine, "DOSBoxPure input movie", 22));
+			if (!relative) fseek(f, 0, SEEK_SET);
+			ReadNext();
+			PushNotify("Playing input movie", 1000, RETRO_LOG_INFO);
+		}
+	}
+
+	void Stop()
+	{
+		if (!f) return;
+		if (mode == RECORD) Put('E', "");
+		fclose(f);
+		f = NULL;
+		mode = OFF;
+	}
+
+	void Fail(const char* msg)
+	{
+		PushNotify(ZL_String::format("%s '%s'", msg, path.c_str()).c_str(), 5000, RETRO_LOG_ERROR);
+		if (f) { fclose(f); f = NULL; }
+		mode = OFF;
+		if (Headless) ZL_Application::Quit(1);
+	}
+
+	bool WriteState(const char* statePath)
+	{
+		const size_t sz = retro_serialize_size();
+		std::vector<unsigned char> buf(16 + sz);
+		memcpy(&buf[0], "RASTATE\1MEM ", 12);
+		for (int i = 0; i != 4; i++) buf[12 + i] = (unsigned char)(sz >> (i * 8));
+		FILE* sf = (retro_serialize(&buf[16], sz) ? fopen_wrap(statePath, "wb") : NULL);
+		if (!sf) return false;
+		const bool res = (fwrite(&buf[0], buf.size(), 1, sf) == 1);
+		fclose(sf);
+		return res;
+	}
+
+	void Put(char type, const char* args)
+	{
+		fprintf(f, "%u %c%s\n", frame - lastFrame, type, args);
+		lastFrame = frame;
+	}
+
+	void RecordKey(bool down, unsigned keycode, unsigned mod)
+	{
+		char args[32];
+		snprintf(args, sizeof(args), " %u %u %u", (unsigned)down, keycode, mod);
+		Put('K', args);
+	}
+
+	void RecordInput(unsigned port, unsigned device, unsigned index, unsigned id, int16_t value)
+	{
+		SValue* v = Find(port, device, index, id);
+		if (v && v->value == value) return;
+		if (v) v->value = value; else values.push_back({ (Bit8u)port, (Bit8u)device, (Bit8u)index, (Bit16u)id, value });
+		char args[64];
+		snprintf(args, sizeof(args), " %u %u %u %u %d", port, device, index, id, value);
+		Put('I', args);
+	}
+
+	void RecordLoad()
+	{
+		// A state loaded while recording is stored along with the movie so playback can load the same one
+		if (!WriteState(StatePath(++loads).c_str())) return;
+		char args[16];
+		snprintf(args, sizeof(args), " %u", loads);
+		Put('L', args);
+	}
+
+	SValue* Find(unsigned port, unsigned device, unsigned index, unsigned id)
+	{
+		for (SValue& v : values)
+			if (v.port == port && v.device == device && v.index == index && v.id == id)
+				return &v;
+		return NULL;
+	}
+
+	int16_t Get(unsigned port, unsigned device, unsigned index, unsigned id)
+	{
+		const SValue* v = Find(port, device, index, id);
+		return (v ? v->value : 0);
+	}
+
+	void ReadNext()
+	{
+		unsigned n;
+		nextType = 0;
+		while (fgets(nextLine, sizeof(nextLine), f))
+			if (sscanf(nextLine, "%u %c", &n, &nextType) == 2) { nextFrame = (relative ? nextFrame + n : n); return; }
+		nextType = 0; // without an end line the last values stay in effect
+		nextFrame = ~0u;
+	}
+
+	void BeforeRun()
+	{
+		if (mode == RECORD)
+		{
+			if (throttle == ThrottleMode) return;
+			throttle = ThrottleMode;
+			char args[16];
+			snprintf(args, sizeof(args), " %u", (unsigned)throttle);
+			Put('T', args);
+			return;
+		}
+		for (unsigned a, b, c, d; nextFrame <= frame; ReadNext())
+		{
+			const char* args = strchr(nextLine, nextType) + 1;
+			int v;
+			switch (nextType)
+			{
+				case 'K':
+					if (sscanf(args, "%u %u %u", &a, &b, &c) == 3) retro_keyboard_event_cb(!!a, b, 0, (uint16_t)c);
+					break;
+				case 'I':
+					if (sscanf(args, "%u %u %u %u %d", &a, &b, &c, &d, &v) != 5) break;
+					if (SValue* val = Find(a, b, c, d)) val->value = (int16_t)v;
+					else values.push_back({ (Bit8u)a, (Bit8u)b, (Bit8u)c, (Bit16u)d, (int16_t)v });
+					break;
+				case 'T': // pausing doesn't change what gets emulated and would wait for the user
+					if (sscanf(args, "%u", &a) == 1) ApplyFPSLimit((unsigned char)(a == RETRO_THROTTLE_FRAME_STEPPING ? RETRO_THROTTLE_NONE : a), true);
+					break;
+				case 'L':
+					if (sscanf(args, "%u", &a) == 1 && !RunLoad(StatePath(a).c_str())) { Fail("Could not load state of input movie"); return; }
+					break;
+				case 'E':
+					Stop();
+					PushNotify("Input movie finished", 2000, RETRO_LOG_INFO);
+					if (Headless) ZL_Application::Quit();
+					return;
+			}
+		}
+	}
+} InputMovie;
+
+static void CoreSetGeometry(const retro_game_geometry& geometry)
+{
+	ZL_ASSERT(av.geometry.max_width == geometry.max_width && av.geometry.max_height == geometry.max_height);
+	av.geometry = geometry;
+	DoApplyGeometry = true;
+}
+
+static void CoreSetAVInfo(const retro_system_av_info& avinfo)
+{
+	av = avinfo;
+	ApplyFPSLimit();
+	if (av.geometry.max_width > (unsigned)srfCore.GetWidth() ||av.geometry.max_height > (unsigned)srfCore.GetHeight())
+	{
+		srfCore = ZL_Surface(av.geometry.max_width, av.geometry.max_height);
+		InterfaceSettings.pending |= SInterfaceSettings::SHADER | SInterfaceSettings::GEOMETRY;
+		DoApplyInterfaceOptions = true;
+	}
+	else { srfCore.RenderToBegin(true, false); srfCore.RenderToEnd(); } // clear to black
+	DoApplyGeometry = true;
+}
+
+static void CoreSetStatus(const char* msg)
+{
+	txtOSD.SetText(msg, ZLWIDTH);
+	txtOSDTick = ZLTICKS;
+}
+
+static void DrainThreadEvents()
+{
+	TRACE_SCOPE("ThreadEvents");
+	SThreadEvents::SEvent e;
+	while (ThreadEvents.Pop(e))
+	{
+		switch (e.type)
+		{
+			case SThreadEvents::NOTIFY: PushNotify(e.text, e.duration, e.level); break;
+			case SThreadEvents::STATUS: CoreSetStatus(e.text); break;
+			case SThreadEvents::GEOMETRY: CoreSetGeometry(e.av.geometry); break;
+			case SThreadEvents::AV_INFO: CoreSetAVInfo(e.av); break;
+			case SThreadEvents::SHUTDOWN: ZL_Application::Quit(); break;
+		}
+	}
+	if (const unsigned dropped = ThreadEvents.dropped.exchange(0, std::memory_order_relaxed))
+		Log.Printf(RETRO_LOG_WARN, "Dropped %u messages sent from other threads", dropped);
+}
+
+static bool RETRO_CALLCONV retro_environment_cb(unsigned cmd, void *data)
+{
+	if (MainThreadID != SDL_GetThreadID())
+	{
+		// Commands that change frontend state are queued for the frame loop when sent from a core worker thread
+		switch (cmd)
+		{
+			case RETRO_ENVIRONMENT_SET_GEOMETRY:
+			{
+				retro_system_av_info avinfo;
+				avinfo.geometry = *((retro_game_geometry*)data);
+				return ThreadEvents.Post(SThreadEvents::GEOMETRY, NULL, 0, RETRO_LOG_INFO, &avinfo);
+			}
+			case RETRO_ENVIRONMENT_SET_SYSTEM_AV_INFO:
+				return ThreadEvents.Post(SThreadEvents::AV_INFO, NULL, 0, RETRO_LOG_INFO, (retro_system_av_info*)data);
+			case RETRO_ENVIRONMENT_SET_MESSAGE_EXT:
+			{
+				const retro_message_ext* msg = (const retro_message_ext*)data;
+				ZL_ASSERT(msg->type == RETRO_MESSAGE_TYPE_STATUS || msg->type == RETRO_MESSAGE_TYPE_NOTIFICATION);
+				return ThreadEvents.Post((msg->type == RETRO_MESSAGE_TYPE_STATUS ? SThreadEvents::STATUS : SThreadEvents::NOTIFY), msg->msg, msg->duration, msg->level);
+			}
+			case RETRO_ENVIRONMENT_SHUTDOWN:
+				return ThreadEvents.Post(SThreadEvents::SHUTDOWN);
+		}
+		ZL_ASSERT(cmd == RETRO_ENVIRONMENT_GET_VFS_INTERFACE || cmd == RETRO_ENVIRONMENT_GET_VARIABLE || cmd == RETRO_ENVIRONMENT_SET_VARIABLE || cmd == RETRO_ENVIRONMENT_GET_SAVE_DIRECTORY || cmd == RETRO_ENVIRONMENT_GET_SYSTEM_DIRECTORY || cmd == RETRO_ENVIRONMENT_GET_LOG_INTERFACE);
+	}
+	switch (cmd)
+	{
+		case RETRO_ENVIRONMENT_SET_SUPPORT_NO_GAME:
+			return true;
+		case RETRO_ENVIRONMENT_GET_SAVE_DIRECTORY:
+			*((const char **)data) = PathSaves.c_str();
+			return true;
+		case RETRO_ENVIRONMENT_GET_SYSTEM_DIRECTORY:
+			*((const char **)data) = PathSystem.c_str();
+			return true;
+		case RETRO_ENVIRONMENT_GET_LOG_INTERFACE:
+			((retro_log_callback*)data)->log = SLog::LogCallback;
+			return true;
+		case RETRO_ENVIRONMENT_SET_KEYBOARD_CALLBACK:
+			retro_keyboard_event_cb = ((struct retro_keyboard_callback*)data)->callback;
+			return true;
+		case RETRO_ENVIRONMENT_SET_CORE_OPTIONS_UPDATE_DISPLAY_CALLBACK:
+			//static retro_core_options_update_display_callback_t update_display_cb;
+			//update_display_cb = ((struct retro_core_options_update_display_callback*)data)->callback;
+			//return true;
+			return false;
+		case RETRO_ENVIRONMENT_SET_DISK_CONTROL_EXT_INTERFACE:
+			//static retro_disk_control_ext_callback disk_control_cb;
+			//disk_control_cb = *((struct retro_disk_control_ext_callback*)data);
+			//return true;
+			return false;
+		case RETRO_ENVIRONMENT_SET_DISK_CONTROL_INTERFACE:
+			return false;
+		case RETRO_ENVIRONMENT_GET_PERF_INTERFACE:
+		{
+			retro_perf_callback* cb = (retro_perf_callback*)data;
+			cb->get_time_usec    = SPerfCounters::GetTimeUsec;
+			cb->get_cpu_features = SPerfCounters::GetCPUFeatures;
+			cb->get_perf_counter = SPerfCounters::GetCounter;
+			cb->perf_register    = SPerfCounters::Register;
+			cb->perf_start       = SPerfCounters::Start;
+			cb->perf_stop        = SPerfCounters::Stop;
+			cb->perf_log         = SPerfCounters::Log;
+			return true;
+		}
+		case RETRO_ENVIRONMENT_GET_CORE_OPTIONS_VERSION:
+			*(unsigned*)data = 2;
+			return true;
+		case RETRO_ENVIRONMENT_SET_CORE_OPTIONS_V2:
+			mtxCoreOptions.Lock();
+			for (const retro_core_option_v2_definition *it = ((retro_core_options_v2*)data)->definitions; it->key; it++)
+			{
+				if (!SettingsWriter.Has(it->key)) continue;
+				ZL_String val = SettingsWriter.Get(it->key);
+				if (val != it->default_value) { for (const retro_core_option_value *v = it->values; v->value; v++) { if (val == v->value) goto keyok; } }
+				if (SInterfaceSettings::IsFreeForm(it->key)) goto keyok;
+				SettingsWriter.Del(it->key);
+				if (const int id = SInterfaceSettings::Find(it->key) + 1) InterfaceSettings.stale |= (1u << (id - 1));
+				keyok:;
+			}
+			OptionStore.Publish();
+			mtxCoreOptions.Unlock();
+			return true;
+		case RETRO_ENVIRONMENT_GET_VARIABLE:
+		{
+			const char* val = NULL;
+			if (!OptionStore.Get(((retro_variable*)data)->key, val))
+			{
+				// First query of a key adds it to the store
+				mtxCoreOptions.Lock();
+				OptionStore.Publish(((retro_variable*)data)->key);
+				mtxCoreOptions.Unlock();
+				OptionStore.Get(((retro_variable*)data)->key, val);
+			}
+			if (!val) return false;
+			((retro_variable*)data)->value = val;
+			return true;
+		}
+		case RETRO_ENVIRONMENT_SET_VARIABLE:
+		{
+			mtxCoreOptions.Lock();
+			SettingsWriter.Set(((retro_variable*)data)->key, ((retro_variable*)data)->value); // NULL value deletes
+			DirtySettings();
+			OptionStore.Publish(((retro_variable*)data)->key);
+			VariablesUpdated = true;
+			const int interfaceId = SInterfaceSettings::Find(((retro_variable*)data)->key);
+			if (interfaceId >= 0) { InterfaceSettings.stale |= (1u << interfaceId); DoApplyInterfaceOptions = true; }
+			mtxCoreOptions.Unlock();
+			return true;
+		}
+		case RETRO_ENVIRONMENT_GET_VARIABLE_UPDATE:
+			*((bool*)data) = VariablesUpdated;
+			VariablesUpdated = false;
+			return true;
+		case RETRO_ENVIRONMENT_SET_CORE_OPTIONS_DISPLAY:
+			return false;
+		case RETRO_ENVIRONMENT_SET_MEMORY_MAPS:
+			return false;
+		case RETRO_ENVIRONMENT_SET_SUPPORT_ACHIEVEMENTS:
+			return false;
+		case RETRO_ENVIRONMENT_SET_CONTROLLER_INFO:
+			return false;
+		case RETRO_ENVIRONMENT_SET_INPUT_DESCRIPTORS:
+			return false;
+		case RETRO_ENVIRONMENT_GET_VFS_INTERFACE:
+		{
+			retro_vfs_interface_info* vfs = (retro_vfs_interface_info*)data;
+			static retro_vfs_interface vfs_iface =
+			{
+				NULL, NULL, NULL, NULL, NULL, NULL, NULL, NULL, NULL, NULL, NULL, NULL, NULL,
+				retro_vfs_mkdir_impl,
+				retro_vfs_opendir_impl,
+				retro_vfs_readdir_impl,
+				retro_vfs_dirent_get_name_impl,
+				retro_vfs_dirent_is_dir_impl,
+				retro_vfs_closedir_impl
+			};
+			vfs->iface = &vfs_iface;
+			return true;
+		}
+		case RETRO_ENVIRONMENT_GET_THROTTLE_STATE:
+		{
+			float corefps = (float)av.timing.fps, vsyncfps = ZL_Application::GetVsyncFps();
+			if (vsyncfps && vsyncfps != corefps)
+			{
+				((retro_throttle_state*)data)->mode = RETRO_THROTTLE_VSYNC;
+				((retro_throttle_state*)data)->rate = vsyncfps;
+			}
+			else
+			{
+				((retro_throttle_state*)data)->mode = ThrottleMode;
+				((retro_throttle_state*)data)->rate = corefps * (ThrottleMode == RETRO_THROTTLE_SLOW_MOTION ? SlowRate : ThrottleMode == RETRO_THROTTLE_FAST_FORWARD ? FastRate : ThrottleMode == RETRO_THROTTLE_FRAME_STEPPING ? 0.0f : 1.0f);
+			}
+			return true;
+		}
+		case RETRO_ENVIRONMENT_SET_GEOMETRY:
+			CoreSetGeometry(*((retro_game_geometry*)data));
+			return true;
+		case RETRO_ENVIRONMENT_SET_SYSTEM_AV_INFO:
+			CoreSetAVInfo(*((retro_system_av_info*)data));
+			return true;
+		case RETRO_ENVIRONMENT_GET_PREFERRED_HW_RENDER:
+			#ifdef ZL_VIDEO_OPENGL_ES2
+			#define DBP_RETRO_HW_CONTEXT RETRO_HW_CONTEXT_OPENGLES2
+			#elif defined(ZL_VIDEO_OPENGL_CORE)
+			#define DBP_RETRO_HW_CONTEXT RETRO_HW_CONTEXT_OPENGL_CORE
+			#else
+			#define DBP_RETRO_HW_CONTEXT RETRO_HW_CONTEXT_OPENGL
+			#endif
+			*(retro_hw_context_type*)data = DBP_RETRO_HW_CONTEXT;
+			return true;
+		case RETRO_ENVIRONMENT_SET_HW_RENDER:
+			ZL_ASSERT(((retro_hw_render_callback*)data)->context_type == DBP_RETRO_HW_CONTEXT);
+			((retro_hw_render_callback*)data)->get_proc_address = retro_hw_get_proc_address;
+			((retro_hw_render_callback*)data)->get_current_framebuffer = retro_hw_get_current_framebuffer;
+			((retro_hw_render_callback*)data)->context_reset();
+			return true;
+		case RETRO_ENVIRONMENT_SET_NETPACKET_INTERFACE:
+			return true;
+		case RETRO_ENVIRONMENT_SET_MESSAGE_EXT:
+		{
+			const retro_message_ext* msg = (const retro_message_ext*)data;
+			if (msg->type == RETRO_MESSAGE_TYPE_STATUS)
+				CoreSetStatus(msg->msg);
+			else if (msg->type == RETRO_MESSAGE_TYPE_NOTIFICATION)
+				PushNotify(msg->msg, msg->duration, msg->level);
+			else { ZL_ASSERT(0); }
+			return true;
+		}
+		case RETRO_ENVIRONMENT_SHUTDOWN:
+			ZL_Application::Quit();
+			return true;
+	}
+	ZL_ASSERTMSG1(false, "[retro_environment_cb] UNSUPPORTED CMD: %d", cmd);
+	return false;
+}
+
+static void MixerCallBack(unsigned char* stream, size_t samples)
+{
+	TRACE_SCOPE("MIXER_CallBack");
+	void MIXER_CallBack(void *userdata, unsigned char *stream, int len);
+	MIXER_CallBack(NULL, stream, (int)(samples * 4));
+}
+
+static bool AudioMix(short* buffer, unsigned int samples, bool need_mix)
+{
+	if (Trace.active.load(std::memory_order_relaxed)) Trace.NameThread("Audio");
+	TRACE_SCOPE("AudioMix");
+	unsigned char tm = (LastAudioThrottleMode == RETRO_THROTTLE_FAST_FORWARD ? RETRO_THROTTLE_FAST_FORWARD : ThrottleMode);
+	LastAudioThrottleMode = ThrottleMode;
+	short* const mixed = buffer;
+
+	extern Bit32u DBP_MIXER_DoneSamplesCount();
+	size_t have = DBP_MIXER_DoneSamplesCount(), want = samples;
+	if (tm == RETRO_THROTTLE_FAST_FORWARD) want = (FastRate ? (size_t)(samples * FastRate) : (size_t)DBP_MIXER_DoneSamplesCount());
+	if (tm == RETRO_THROTTLE_SLOW_MOTION) want = (size_t)(samples * SlowRate);
+	if (have < want)
+	{
+		TRACE_SCOPE("AudioMix wait");
+		for (unsigned int tick = 0; have < want;)
+		{
+			ZL_Thread::Sleep(0);
+			have = DBP_MIXER_DoneSamplesCount();
+			if (have >= want) break;
+			if (!tick) tick = SDL_GetTicks();
+			if (((int)SDL_GetTicks() - (int)tick) >= (AudioLatency)) { /*ZL_LOG("AUDIOMIX", "Not enough audio");*/ break; } // emulation lagging (or crashed)
+		}
+	}
+
+	if (have == 0)
+	{
+		//ZL_LOG("AUDIOMIX", "Have zero audio");
+		memset(buffer, 0, samples * 4);
+		if (Capture.active) Capture.PushAudio(mixed, samples);
+		return true;
+	}
+
+	const bool catchup = (have > want * (av.timing.fps < 50 ? 20 : 6)/4 && want == samples);
+	static unsigned int catchups;
+	if (catchup || catchups)
+	{
+		// When running with vsync we need to allow catching up for potentially much longer (until the emulation skips a frame)
+		unsigned int skip_catchups = 30; float corefps = (float)av.timing.fps, vsyncfps = ZL_Application::GetVsyncFps();
+		if (vsyncfps && vsyncfps > corefps) skip_catchups += (unsigned int)(1000.0f / ((vsyncfps - corefps) * AudioLatency));
+		catchups += (catchup ? 2 : -1);
+		//if (catchups > skip_catchups) want = samples * (((have - want) <= 800 ? 40800 : (40000 + have - want))) / 40000; // alternative speed up playback
+		//if (catchups > skip_catchups*2) catchups = 20;
+		if (catchups > skip_catchups || have > want * 3) AudioSkip = true;
+		Log.Printf(RETRO_LOG_DEBUG, "AUDIOMIX: Catch-up - Have %d but want %d (catchups: %u)", (int)have, (int)want, catchups);
+	}
+
+	if (have < want || want != samples || AudioSkip || tm == RETRO_THROTTLE_FRAME_STEPPING)
+	{
+		enum { UI_MAX_SAMPLES = 4096*4 };
+		static short stretchbuf[UI_MAX_SAMPLES * 2]; // stereo
+
+		size_t use;
+		if (tm == RETRO_THROTTLE_FAST_FORWARD || tm == RETRO_THROTTLE_SLOW_MOTION) use = ZL_Math::Min(have, want);
+		else if (have >= want || AudioSkip || tm == RETRO_THROTTLE_FRAME_STEPPING)
+		{
+			// When lagging behind, don't speed audio up and just scrap it instead (one hiccup is better than prolonged audio speedup)
+			if (AudioSkip) { Log.Printf(RETRO_LOG_DEBUG, "AUDIOMIX: Audio Skip!"); }
+			AudioSkip = false;
+			catchups = 0;
+			use = ZL_Math::Min(have, (size_t)samples);
+		}
+		else use = ((have < 10) ? have : (have * 7 / 10)); // use 70% for stretching while ahead, keep 20% as additional buffer to not fall behind again
+
+		if (use > UI_MAX_SAMPLES) use = UI_MAX_SAMPLES;
+		const double audio_stretch = (tm == RETRO_THROTTLE_FRAME_STEPPING ? 1.0 : (double)use / samples); // don't stretch during frame stepping
+		Log.Printf(RETRO_LOG_DEBUG, "AUDIOMIX: Stretch %d (of %d available total) into %d (factor %f)", (int)use, (int)have, (int)samples, (float)audio_stretch);
+		for (size_t scrap, keep = want / 5; have >= samples && have > use + keep; have -= scrap)
+		{
+			scrap = ZL_Math::Min((size_t)(have - use - keep), (size_t)UI_MAX_SAMPLES);
+			MixerCallBack((unsigned char*)stretchbuf, scrap);
+			Log.Printf(RETRO_LOG_DEBUG, "AUDIOMIX: Scrapping %d (of %d available total)", (int)scrap, (int)have);
+		}
+		MixerCallBack((unsigned char*)stretchbuf, use);
+
+		if (0)
+		{
+			for (size_t i = 0; i != samples*2; i++, buffer++) // repeat samples
+			{
+				buffer[0] = stretchbuf[i < (use*2) ? i : (use*2) - (i % (use*2))];
+			}
+		}
+		else
+		{
+			for (size_t i = 0, jMax = use - 1; i != samples; i++, buffer += 2) // linear interpolation
+			{
+				const double src_pos_float = i * audio_stretch;
+				const size_t j0 = (size_t)src_pos_float, j1 = j0 + (size_t)(j0 != jMax);
+				const double frac = src_pos_float - j0;
+				buffer[0] = (short)((1.0 - frac) * stretchbuf[j0 * 2 + 0] + frac * stretchbuf[j1 * 2 + 0]); // stretchbuf[j0 * 2 + 0] // simple nearest
+				buffer[1] = (short)((1.0 - frac) * stretchbuf[j0 * 2 + 1] + frac * stretchbuf[j1 * 2 + 1]); // stretchbuf[j0 * 2 + 1] // simple nearest
+			}
+		}
+
+		if (tm == RETRO_THROTTLE_FRAME_STEPPING && use < samples) { memset(buffer - (samples - use) * 2, 0, (samples - use) * 4); }
+		ui_last_audio_stretch = (float)audio_stretch;
+	}
+	else
+	{
+		MixerCallBack((unsigned char*)buffer, want);
+	}
+	if (Capture.active) Capture.PushAudio(mixed, samples);
+	return true;
+}
+
+// Hardware performance counters around retro_run through Linux perf_event_open, enabled with --hwcounters (or --hwsample)
+// The counters are opened before the core starts its threads and are inherited by all threads created afterwards, so they
+// count the whole process (emulation thread, audio, log, settings and input threads) and are reported as such
+static struct SHwCounters
+{
+	enum { CYCLES, INSTRUCTIONS, CACHE_MISSES, BRANCH_MISSES, NUM };
+	bool enabled, sampling;
+	int fds[NUM];
+	Bit64u start[NUM], total[NUM], window[NUM];
+	float ipc, cacheMPKI, branchMPKI; // rates over the last second for the overlay
+	ticks_t windowTick;
+	std::vector<int> sampleFds; std::vector<unsigned char*> rings; size_t ringSize, pageSize; // one sampling event per CPU
+	std::vector<std::pair<Bit64u, unsigned> > samples; // instruction pointer and hit count, merged at exit
+
+	#if defined(__linux__)
+	static int OpenEvent(unsigned config, Bit64u freq, int cpu)
+	{
+		perf_event_attr attr;
+		memset(&attr, 0, sizeof(attr));
+		attr.size = sizeof(attr);
+		attr.type = PERF_TYPE_HARDWARE;
+		attr.config = config;
+		attr.inherit = 1;
+		attr.exclude_kernel = attr.exclude_hv = 1;
+		if (freq) { attr.freq = 1; attr.sample_freq = freq; attr.sample_type = PERF_SAMPLE_IP; }
+		return (int)syscall(SYS_perf_event_open, &attr, 0, cpu, -1, 0);
+	}
+
+	static Bit64u Read(int fd) { Bit64u v = 0; return (read(fd, &v, sizeof(v)) == sizeof(v) ? v : 0); }
+
+	void Open(bool withSampling)
+	{
+		static const unsigned configs[NUM] = { PERF_COUNT_HW_CPU_CYCLES, PERF_COUNT_HW_INSTRUCTIONS, PERF_COUNT_HW_CACHE_MISSES, PERF_COUNT_HW_BRANCH_MISSES };
+		for (int i = 0; i != NUM; i++)
+			if ((fds[i] = OpenEvent(configs[i], 0, -1)) < 0) { fds[i] = 0; fprintf(stderr, "perf_event_open failed (check /proc/sys/kernel/perf_event_paranoid)\n"); Close(); return; }
+		enabled = true;
+		if (!withSampling) return;
+
+		// The kernel refuses to mmap an inherited event that follows the task across all CPUs (cpu -1),
+		// so sampling opens one inherited event with its own ring buffer per CPU instead
+		pageSize = (size_t)sysconf(_SC_PAGESIZE);
+		ringSize = pageSize * (1 + 16);
+		for (int cpu = 0, cpuMax = (int)sysconf(_SC_NPROCESSORS_CONF); cpu < cpuMax; cpu++)
+		{
+			const int fd = OpenEvent(PERF_COUNT_HW_CPU_CYCLES, 4000, cpu);
+			if (fd < 0) continue; // offline CPU
+			unsigned char* ring = (unsigned char*)mmap(NULL, ringSize, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+			if (ring == (unsigned char*)MAP_FAILED) { fprintf(stderr, "Mapping the perf sample buffer for CPU %d failed (%s)\n", cpu, strerror(errno)); close(fd); continue; }
+			sampleFds.push_back(fd);
+			rings.push_back(ring);
+		}
+		if (rings.empty()) { fprintf(stderr, "Sampling with perf_event_open failed, hotspots.txt will not be written\n"); return; }
+		sampling = true;
+	}
+
+	void Close()
+	{
+		for (int& fd : fds) { if (fd > 0) close(fd); fd = 0; }
+		for (unsigned char* ring : rings) munmap(ring, ringSize);
+		for (int fd : sampleFds) close(fd);
+		rings.clear();
+		sampleFds.clear();
+		enabled = sampling = false;
+	}
+
+	void Begin() { for (int i = 0; i != NUM; i++) start[i] = Read(fds[i]); }
+
+	void End(bool addToTotal)
+	{
+		for (int i = 0; i != NUM; i++) { Bit64u d = Read(fds[i]) - start[i]; window[i] += d; if (addToTotal) total[i] += d; }
+		if (ZLSINCE(windowTick) >= 1000)
+		{
+			windowTick = ZLTICKS;
+			ipc = (window[CYCLES] ? (float)window[INSTRUCTIONS] / window[CYCLES] : 0.0f);
+			cacheMPKI = (window[INSTRUCTIONS] ? window[CACHE_MISSES] * 1000.0f / window[INSTRUCTIONS] : 0.0f);
+			branchMPKI = (window[INSTRUCTIONS] ? window[BRANCH_MISSES] * 1000.0f / window[INSTRUCTIONS] : 0.0f);
+			memset(window, 0, sizeof(window));
+		}
+		if (sampling) DrainSamples();
+	}
+
+	void DrainSamples()
+	{
+		for (unsigned char* ring : rings) DrainRing(ring);
+		if (samples.size() > 1000000) MergeSamples();
+	}
+
+	void DrainRing(unsigned char* ring)
+	{
+		// Samples of all threads running on the ring buffer's CPU
+		perf_event_mmap_page* meta = (perf_event_mmap_page*)ring;
+		const unsigned char* data = ring + pageSize;
+		const size_t dataSize = ringSize - pageSize;
+		const Bit64u head = meta->data_head;
+		__sync_synchronize();
+		for (Bit64u tail = meta->data_tail; tail < head;)
+		{
+			unsigned char rec[64];
+			perf_event_header hdr;
+			for (size_t i = 0; i != sizeof(hdr); i++) ((unsigned char*)&hdr)[i] = data[(tail + i) % dataSize];
+			if (!hdr.size) break;
+			if (hdr.type == PERF_RECORD_SAMPLE && hdr.size >= sizeof(hdr) + 8 && hdr.size <= sizeof(rec))
+			{
+				for (size_t i = 0; i != hdr.size; i++) rec[i] = data[(tail + i) % dataSize];
+				Bit64u ip; memcpy(&ip, rec + sizeof(hdr), 8);
+				samples.push_back(std::make_pair(ip, 1u));
+			}
+			tail += hdr.size;
+		}
+		__sync_synchronize();
+		meta->data_tail = head;
+	}
+
+	void MergeSamples()
+	{
+		std::sort(samples.begin(), samples.end());
+		size_t n = 0;
+		for (size_t i = 0; i != samples.size(); i++)
+			if (n && samples[n - 1].first == samples[i].first) samples[n - 1].second += samples[i].second;
+			else samples[n++] = samples[i];
+		samples.resize(n);
+	}
+
+	struct SSymbol { Bit64u addr, size; std::string name; bool operator<(const SSymbol& o) const { return addr < o.addr; } };
+	struct SLoad { Bit64u offset, vaddr, size; };
+
+	static void LoadSymbols(const char* path, std::vector<SSymbol>& syms, std::vector<SLoad>& loads)
+	{
+		// Read function symbols from the ELF file of the program (static functions are included as long as it isn't stripped)
+		FILE* f = fopen(path, "rb");
+		if (!f) return;
+		std::vector<unsigned char> elf;
+		fseek(f, 0, SEEK_END); elf.resize((size_t)ftell(f)); fseek(f, 0, SEEK_SET);
+		if (elf.size() < sizeof(Elf64_Ehdr) || !fread(&elf[0], elf.size(), 1, f)) elf.clear();
+		fclose(f);
+		if (elf.empty() || memcmp(&elf[0], ELFMAG, SELFMAG) || elf[EI_CLASS] != ELFCLASS64) return;
+		const Elf64_Ehdr* eh = (const Elf64_Ehdr*)&elf[0];
+		for (int i = 0; i != eh->e_phnum; i++)
+		{
+			const Elf64_Phdr* ph = (const Elf64_Phdr*)&elf[eh->e_phoff + (size_t)i * eh->e_phentsize];
+			if (ph->p_type == PT_LOAD) loads.push_back({ ph->p_offset, ph->p_vaddr, ph->p_filesz });
+		}
+		const Elf64_Shdr* sh = (const Elf64_Shdr*)&elf[eh->e_shoff];
+		for (int pass = 0; pass != 2 && syms.empty(); pass++) // prefer the full symbol table, fall back to the dynamic symbols
+			for (int i = 0; i != eh->e_shnum; i++)
+			{
+				if (sh[i].sh_type != (pass ? SHT_DYNSYM : SHT_SYMTAB) || sh[i].sh_link >= eh->e_shnum) continue;
+				const Elf64_Sym* sym = (const Elf64_Sym*)&elf[sh[i].sh_offset];
+				const char* strtab = (const char*)&elf[sh[sh[i].sh_link].sh_offset];
+				for (size_t j = 0, jMax = sh[i].sh_size / sizeof(Elf64_Sym); j != jMax; j++)
+				{
+					if (ELF64_ST_TYPE(sym[j].st_info) != STT_FUNC || !sym[j].st_value) continue;
+					const char* name = strtab + sym[j].st_name;
+					int status = 0; char* demangled = abi::__cxa_demangle(name, NULL, NULL, &status);
+					syms.push_back({ sym[j].st_value, sym[j].st_size, (demangled ? demangled : name) });
+					free(demangled);
+				}
+			}
+		std::sort(syms.begin(), syms.end());
+	}
+
+	void ReportHotspots()
+	{
+		if (!sampling) return;
+		DrainSamples();
+		MergeSamples();
+		Bit64u count = 0;
+		for (const std::pair<Bit64u, unsigned>& s : samples) count += s.second;
+		if (!count) return;
+
+		char exe[1024]; ssize_t exeLen = readlink("/proc/self/exe", exe, sizeof(exe) - 1);
+		exe[exeLen > 0 ? exeLen : 0] = '\0';
+		std::vector<SSymbol> syms; std::vector<SLoad> loads;
+		LoadSymbols(exe, syms, loads);
+
+		struct SMap { Bit64u start, end, offset; std::string path; };
+		std::vector<SMap> maps;
+		if (FILE* f = fopen("/proc/self/maps", "r"))
+		{
+			char line[1024 + 128], path[1024];
+			unsigned long long mstart, mend, moffset;
+			while (fgets(line, sizeof(line), f))
+			{
+				path[0] = '\0';
+				if (sscanf(line, "%llx-%llx %*s %llx %*s %*s %1023s", &mstart, &mend, &moffset, path) >= 3)
+					maps.push_back({ mstart, mend, moffset, path });
+			}
+			fclose(f);
+		}
+
+		// Attribute every sample to a function of the program or to a module
+		std::vector<std::pair<Bit64u, std::string> > hot;
+		std::map<std::string, Bit64u> byName;
+		for (const std::pair<Bit64u, unsigned>& s : samples)
+		{
+			std::string name = "[unknown]";
+			for (const SMap& m : maps)
+			{
+				if (s.first < m.start || s.first >= m.end) continue;
+				const Bit64u fileofs = s.first - m.start + m.offset;
+				if (m.path != exe) { name = "[" + m.path.substr(m.path.find_last_of('/') + 1) + "]"; break; }
+				for (const SLoad& l : loads)
+				{
+					if (fileofs < l.offset || fileofs >= l.offset + l.size) continue;
+					const Bit64u vaddr = fileofs - l.offset + l.vaddr;
+					std::vector<SSymbol>::const_iterator it = std::upper_bound(syms.begin(), syms.end(), SSymbol{ vaddr, 0, std::string() });
+					if (it != syms.begin() && vaddr < (--it)->addr + ZL_Math::Max(it->size, (Bit64u)1)) name = it->name;
+					else name = ZL_String::format("[%s+0x%llx]", m.path.substr(m.path.find_last_of('/') + 1).c_str(), (unsigned long long)vaddr);
+					break;
+				}
+				break;
+			}
+			byName[name] += s.second;
+		}
+		for (const std::pair<const std::string, Bit64u>& it : byName) hot.push_back(std::make_pair(it.second, it.first));
+		std::sort(hot.begin(), hot.end(), [](const std::pair<Bit64u, std::string>& a, const std::pair<Bit64u, std::string>& b) { return a.first > b.first; });
+
+		FILE* f = fopen_wrap((std::string(PathSaves) += '/').append("hotspots.txt").c_str(), "wb");
+		for (FILE* out : { stderr, f })
+		{
+			if (!out) continue;
+			fprintf(out, "Top hotspots (%llu samples):\n", (unsigned long long)count);
+			for (size_t i = 0; i != hot.size() && i != 30; i++)
+				fprintf(out, "%6.2f%% %8llu  %s\n", hot[i].first * 100.0 / count, (unsigned long long)hot[i].first, hot[i].second.c_str());
+		}
+		if (f) fclose(f);
+	}
+	#else
+	void Open(bool) { fprintf(stderr, "Hardware performance counters are only supported on Linux\n"); }
+	void Begin() {}
+	void End(bool) {}
+	void ReportHotspots() {}
+	#endif
+} HwCounters;
+
+// Opt-in heap allocation tracking (--alloctrack) counting allocations per frame phase of the main thread and on other threads
+// Also tracks the heap high-water mark (of memory allocated since enabling) which is shown together with the RSS in the frame timing overlay
+static struct SAllocTrack
+{
+	enum { SLOTS = 8, OTHER_THREADS = SLOTS - 1 };
+	std::atomic<bool> enabled;
+	int phase; // current frame profiler phase of the main thread
+	std::atomic<unsigned> count[SLOTS];
+	std::atomic<Bit64u> bytes[SLOTS];
+	std::atomic<Bit64s> live, peak;
+	static thread_local bool mainThread;
+
+	void Enable()
+	{
+		mainThread = true;
+		enabled = true;
+	}
+
+	static size_t BlockSize(void* p)
+	{
+		#if defined(_MSC_VER) || defined(__MINGW32__) || defined(__WIN32__) || defined(WIN32) || defined(_WIN32)
+		return _msize(p);
+		#elif defined(__APPLE__)
+		return malloc_size(p);
+		#else
+		return malloc_usable_size(p);
+		#endif
+	}
+
+	void OnAlloc(void* p)
+	{
+		const size_t sz = BlockSize(p);
+		const int slot = (mainThread ? phase : OTHER_THREADS);
+		count[slot].fetch_add(1, std::memory_order_relaxed);
+		bytes[slot].fetch_add(sz, std::memory_order_relaxed);
+		const Bit64s l = live.fetch_add((Bit64s)sz, std::memory_order_relaxed) + (Bit64s)sz;
+		if (l > peak.load(std::memory_order_relaxed)) peak.store(l, std::memory_order_relaxed); // racy but good enough for a high-water mark
+	}
+
+	void OnFree(void* p)
+	{
+		live.fetch_sub((Bit64s)BlockSize(p), std::memory_order_relaxed);
+	}
+
+	static size_t GetRSS()
+	{
+		#if defined(_MSC_VER) || defined(__MINGW32__) || defined(__WIN32__) || defined(WIN32) || defined(_WIN32)
+		PROCESS_MEMORY_COUNTERS pmc;
+		return (GetProcessMemoryInfo(GetCurrentProcess(), &pmc, sizeof(pmc)) ? (size_t)pmc.WorkingSetSize : 0);
+		#elif defined(__linux__)
+		unsigned long pages = 0;
+		if (FILE* f = fopen("/proc/self/statm", "r")) { if (fscanf(f, "%*u %lu", &pages) != 1) pages = 0; fclose(f); }
+		return (size_t)pages * (size_t)sysconf(_SC_PAGESIZE);
+		#else
+		return 0;
+		#endif
+	}
+} AllocTrack;
+
+thread_local bool SAllocTrack::mainThread;
+
+// The replacement behaves like the standard one and calls the installed new_handler until the allocation succeeds or there is none
+void* operator new(size_t sz)
+{
+	void* p;
+	while ((p = malloc(sz ? sz : 1)) == NULL)
+	{
+		std::new_handler handler = std::get_new_handler();
+		if (!handler) throw std::bad_alloc();
+		handler();
+	}
+	if (AllocTrack.enabled.load(std::memory_order_relaxed)) AllocTrack.OnAlloc(p);
+	return p;
+}
+void* operator new(size_t sz, const std::nothrow_t&) noexcept
+{
+	try { return operator new(sz); }
+	catch (...) { return NULL; }
+}
+void operator delete(void* p) noexcept
+{
+	if (p && AllocTrack.enabled.load(std::memory_order_relaxed)) AllocTrack.OnFree(p);
+	free(p);
+}
+void* operator new[](size_t sz) { return operator new(sz); }
+void* operator new[](size_t sz, const std::nothrow_t& nt) noexcept { return operator new(sz, nt); }
+void operator delete(void* p, const std::nothrow_t&) noexcept { operator delete(p); }
+void operator delete[](void* p) noexcept { operator delete(p); }
+void operator delete[](void* p, const std::nothrow_t&) noexcept { operator delete(p); }
+void operator delete(void* p, size_t) noexcept { operator delete(p); }
+void operator delete[](void* p, size_t) noexcept { operator delete(p); }
+
+// Frame delay (frame_delay=auto or a number of milliseconds) sleeps at the start of the frame interval so the core polls input
+// and runs as late as possible before the frame gets presented, in auto mode sized by the recent frame work and backing off on misses
+static struct SFrameDelay
+{
+	enum { WINDOW = 60, COOLDOWN_FRAMES = 120 };
+	bool enabled, automatic;
+	float delayMs, fixedMs, maxWorkMs, windowMaxMs;
+	float lateX, lateY; // mouse motion that arrived during the wait (core direction, y down)
+	unsigned frames, misses, cooldown;
+	retro_time_t frameStart, workStart;
+
+	void Enable(bool newEnabled, bool newAutomatic, float newFixedMs)
+	{
+		if (enabled == newEnabled && automatic == newAutomatic && fixedMs == newFixedMs) return;
+		enabled = newEnabled; automatic = newAutomatic; fixedMs = newFixedMs;
+		delayMs = (automatic ? 0.0f : fixedMs);
+		frames = misses = cooldown = 0;
+		maxWorkMs = windowMaxMs = 0;
+		lateX = lateY = 0;
+		frameStart = 0;
+	}
+
+	void LateInput()
+	{
+		// ZillaLib dispatched the events of this frame before the wait, so handle the key events that arrived since right away and
+		// count the mouse motion ahead (motion events stay queued for ZillaLib and get subtracted once it reports them next frame)
+		union { unsigned type; struct { unsigned type, timestamp, windowID; unsigned char state, repeat, padding[2]; int scancode, sym; unsigned short mod; } key;
+			struct { unsigned type, timestamp, windowID, which, state; int x, y, xrel, yrel; } motion; unsigned char size[56]; } ev[64]; // SDL2 SDL_Event
+		enum { PEEK = 1, GET = 2, KEYDOWN = 0x300, KEYUP = 0x301, MOUSEMOTION = 0x400 };
+		SDL_PumpEvents();
+		for (int n; (n = SDL_PeepEvents(ev, 64, GET, KEYDOWN, KEYUP)) > 0;)
+			for (int i = 0; i != n; i++)
+			{
+				ZL_KeyboardEvent e = { (ZL_Key)ev[i].key.scancode, ev[i].key.mod, (ev[i].type == KEYDOWN), (ev[i].key.repeat != 0) }; // ZL_Key values are SDL scancodes
+				if (e.is_down) OnKeyDown(e); else OnKeyUp(e);
+			}
+		for (int i = 0, n = SDL_PeepEvents(ev, 64, PEEK, MOUSEMOTION, MOUSEMOTION); i < n; i++) { lateX += ev[i].motion.xrel; lateY += ev[i].motion.yrel; }
+	}
+
+	float IntervalMs() const
+	{
+		const float vsync = ZL_Application::GetVsyncFps(), fps = (vsync > 0 ? vsync : (float)av.timing.fps);
+		return (fps > 0 ? 1000.0f / fps : 0.0f);
+	}
+
+	void Wait()
+	{
+		// Called at the start of OnDraw which is right after the buffer swap or frame limiter wait of the previous frame
+		lateX = lateY = 0;
+		const retro_time_t now = dbp_cpu_features_get_time_usec();
+		const float interval = IntervalMs(), lastFrameMs = (frameStart ? (now - frameStart) / 1000.0f : 0.0f);
+		frameStart = now;
+		if (ThrottleMode != RETRO_THROTTLE_NONE || ThrottlePaused || Unthrottled || Headless || !interval) { workStart = 0; return; }
+
+		if (lastFrameMs > interval * 1.5f && workStart)
+		{
+			// Missed the deadline, back off quickly and hold before creeping up again
+			misses++;
+			if (automatic) delayMs *= 0.5f;
+			cooldown = COOLDOWN_FRAMES;
+		}
+		if (++frames >= WINDOW)
+		{
+			// Leave the slowest frame of the window plus a safety margin, grow in small steps but shrink at once
+			const float target = ZL_Math::Clamp(interval - windowMaxMs - ZL_Math::Max(1.0f, interval * 0.1f), 0.0f, interval * 0.8f);
+			if (!automatic) {}
+			else if (target < delayMs) delayMs = target;
+			else if (!cooldown) delayMs = ZL_Math::Min(delayMs + 0.25f, target);
+			maxWorkMs = windowMaxMs;
+			windowMaxMs = 0;
+			frames = 0;
+		}
+		if (cooldown) cooldown--;
+
+		if (delayMs >= 0.1f)
+		{
+			TRACE_SCOPE("Frame Delay");
+			std::this_thread::sleep_for(std::chrono::microseconds((long long)(delayMs * 1000.0f)));
+			if (!InputThread.Active()) SDL_JoystickUpdate(); // refresh joystick state for the input poll of the core
+			LateInput();
+		}
+		workStart = dbp_cpu_features_get_time_usec();
+	}
+
+	void EndWork()
+	{
+		if (!workStart) return;
+		const float workMs = (dbp_cpu_features_get_time_usec() - workStart) / 1000.0f;
+		if (workMs > windowMaxMs) windowMaxMs = workMs;
+	}
+} FrameDelay;
+
+// Per-phase frame timing shown as an overlay (toggled with a hotkey, also available in release builds)
+static struct SFrameProfiler
+{
+	enum EPhase { RUN, SAVELOAD, OPTIONS, OSD, DRAW, PRESENT, NUM_PHASES };
+	enum { HISTORY = 240 };
+	bool active;
+	unsigned char page; // 0 = off, 1 = frame timing, 2 = core performance counters
+	unsigned head, count, calls, runCalls[HISTORY];
+	float ms[HISTORY][NUM_PHASES], total[HISTORY];
+	retro_time_t frameStart, drawEnd, accAtEnd, acc[NUM_PHASES];
+
+	unsigned allocs[HISTORY][SAllocTrack::SLOTS]; float allocKB[HISTORY];
+	size_t rss; ticks_t rssTick;
+
+	// Entering a phase also attributes allocations on the main thread to it, leaving it returns to retro_run (for OSD) or the remaining frame time
+	retro_time_t Now(EPhase ph) const { AllocTrack.phase = ph; return (active ? dbp_cpu_features_get_time_usec() : 0); }
+	void Add(EPhase ph, retro_time_t start) { AllocTrack.phase = (ph == OSD ? RUN : PRESENT); if (active) acc[ph] += dbp_cpu_features_get_time_usec() - start; }
+	retro_time_t Sum() const { retro_time_t res = 0; for (retro_time_t a : acc) res += a; return res; }
+
+	void NextPage()
+	{
+		page = (page + 1) % 3;
+		if (active == (page != 0)) return;
+		active = (page != 0);
+		head = count = calls = 0;
+		frameStart = 0;
+		memset(acc, 0, sizeof(acc));
+		for (int slot = 0; slot != SAllocTrack::SLOTS; slot++) { AllocTrack.count[slot] = 0; AllocTrack.bytes[slot] = 0; }
+	}
+
+	void BeginFrame()
+	{
+		if (!active) return;
+		const retro_time_t now = dbp_cpu_features_get_time_usec();
+		if (frameStart)
+		{
+			// Time between the end of drawing and the next frame is the buffer swap, vsync and frame limiter wait (minus hotkey actions in between)
+			acc[PRESENT] += (now - drawEnd) - (Sum() - accAtEnd);
+			const unsigned i = head++ % HISTORY;
+			for (int ph = 0; ph != NUM_PHASES; ph++) ms[i][ph] = acc[ph] / 1000.0f;
+			total[i] = (now - frameStart) / 1000.0f;
+			runCalls[i] = calls;
+			if (AllocTrack.enabled)
+			{
+				Bit64u frameBytes = 0;
+				for (int slot = 0; slot != SAllocTrack::SLOTS; slot++)
+				{
+					allocs[i][slot] = AllocTrack.count[slot].exchange(0, std::memory_order_relaxed);
+					frameBytes += AllocTrack.bytes[slot].exchange(0, std::memory_order_relaxed);
+				}
+				allocKB[i] = frameBytes / 1024.0f;
+			}
+			if (count < HISTORY) count++;
+		}
+		memset(acc, 0, sizeof(acc));
+		calls = 0;
+		frameStart = now;
+	}
+
+	void EndFrame(retro_time_t drawStart)
+	{
+		if (!active) return;
+		Add(DRAW, drawStart);
+		drawEnd = dbp_cpu_features_get_time_usec();
+		accAtEnd = Sum();
+	}
+
+	void Draw()
+	{
+		static const char* names[NUM_PHASES] = { "retro_run", "Save/Load", "Options", "OSD upload", "Draw", "Present/Wait" };
+		static const ZL_Color cols[NUM_PHASES] = { ZLRGB(.3,.6,1), ZLRGB(1,.5,0), ZLRGB(1,.9,0), ZLRGB(.7,.3,1), ZLRGB(.2,.9,.3), ZLLUM(.5) };
+		if (!count) return;
+		const float budget = (av.timing.fps ? (float)(1000.0 / av.timing.fps) : 16.667f), pxPerMs = 60.0f / budget;
+		const float w = HISTORY * 2.0f, h = 150.0f, x0 = ZLFROMW(w + 20), y0 = 20;
+
+		float sorted[HISTORY], avg[NUM_PHASES] = { 0 }, avgAllocs[SAllocTrack::SLOTS] = { 0 }, avgKB = 0; unsigned over = 0, avgCalls = 0, maxAllocs = 0;
+		const bool allocTrack = AllocTrack.enabled;
+		for (unsigned n = 0; n != count; n++)
+		{
+			sorted[n] = total[n];
+			if (total[n] > budget * 1.05f) over++; // a little leeway for timer jitter
+			for (int ph = 0; ph != NUM_PHASES; ph++) avg[ph] += ms[n][ph] / count;
+			avgCalls += runCalls[n];
+			if (!allocTrack) continue;
+			unsigned frameAllocs = 0;
+			for (int slot = 0; slot != SAllocTrack::SLOTS; slot++) { avgAllocs[slot] += (float)allocs[n][slot] / count; frameAllocs += allocs[n][slot]; }
+			avgKB += allocKB[n] / count;
+			maxAllocs = ZL_Math::Max(maxAllocs, frameAllocs);
+		}
+		std::sort(sorted, sorted + count);
+		const float p50 = sorted[count * 50 / 100], p95 = sorted[count * 95 / 100], p99 = sorted[count * 99 / 100];
+
+		const int lines = NUM_PHASES + 2 + (HwCounters.enabled ? 1 : 0) + (allocTrack ? 2 : 0) + (InputThread.Active() ? 1 : 0) + (FrameDelay.enabled ? 1 : 0);
+		ZL_Display::FillRect(x0 - 10, y0 - 10, x0 + w + 10, y0 + h + 30 * lines + 10, ZLLUMA(0, .6));
+		for (unsigned n = 0; n != count; n++)
+		{
+			const unsigned i = (head - count + n) % HISTORY;
+			float x = x0 + n * 2.0f, y = y0;
+			for (int ph = 0; ph != NUM_PHASES && y < y0 + h; ph++)
 			{
-				srfCore = ZL_Surface(av.geometry.max_width, av.geometry.max_height);
-				DoApplyInterfaceOptions = true;
+				const float top = ZL_Math::Min(y + ms[i][ph] * pxPerMs, y0 + h);
+				if (top > y) ZL_Display::FillRect(x, y, x + 2, top, cols[ph]);
+				y = top;
 			}
-			else { srfCore.RenderToBegin(true, false); srfCore.RenderToEnd(); } // clear to black
-			DoApplyGeometry = true;
-			return true;
-		case RETRO_ENVIRONMENT_GET_PREFERRED_HW_RENDER:
-			#ifdef ZL_VIDEO_OPENGL_ES2
-			#define DBP_RETRO_HW_CONTEXT RETRO_HW_CONTEXT_OPENGLES2
-			#elif defined(ZL_VIDEO_OPENGL_CORE)
-			#define DBP_RETRO_HW_CONTEXT RETRO_HW_CONTEXT_OPENGL_CORE
-			#else
-			#define DBP_RETRO_HW_CONTEXT RETRO_HW_CONTEXT_OPENGL
-			#endif
-			*(retro_hw_context_type*)data = DBP_RETRO_HW_CONTEXT;
-			return true;
-		case RETRO_ENVIRONMENT_SET_HW_RENDER:
-			ZL_ASSERT(((retro_hw_render_callback*)data)->context_type == DBP_RETRO_HW_CONTEXT);
-			((retro_hw_render_callback*)data)->get_proc_address = retro_hw_get_proc_address;
-			((retro_hw_render_callback*)data)->get_current_framebuffer = retro_hw_get_current_framebuffer;
-			((retro_hw_render_callback*)data)->context_reset();
-			return true;
-		case RETRO_ENVIRONMENT_SET_NETPACKET_INTERFACE:
-			return true;
-		case RETRO_ENVIRONMENT_SET_MESSAGE_EXT:
+		}
+		ZL_Display::DrawLine(x0, y0 + 60, x0 + w, y0 + 60, ZLRGBA(1, .2, .2, .8)); // frame budget
+
+		char buf[128];
+		float y = y0 + h + 30 * lines;
+		if (allocTrack)
 		{
-			const retro_message_ext* msg = (const retro_message_ext*)data;
-			if (msg->type == RETRO_MESSAGE_TYPE_STATUS)
-				{ txtOSD.SetText(msg->msg, ZLWIDTH); txtOSDTick = ZLTICKS; }
-			else if (msg->type == RETRO_MESSAGE_TYPE_NOTIFICATION)
-				vecNotify.push_back({ ZL_TextBuffer(fntOSD, msg->msg), msg->duration, msg->level, ZLTICKS, 0.0f });
-			else { ZL_ASSERT(0); }
-			return true;
+			if (!rssTick || ZLSINCE(rssTick) >= 1000) { rss = SAllocTrack::GetRSS(); rssTick = ZLTICKS; }
+			float sumAllocs = 0; for (float a : avgAllocs) sumAllocs += a;
+			snprintf(buf, sizeof(buf), "Allocs %.1f/frame (%.1f KB, max %u), other threads %.1f", sumAllocs, avgKB, maxAllocs, avgAllocs[SAllocTrack::OTHER_THREADS]);
+			fntOSD.Draw(x0, y, buf, (sumAllocs ? ZLRGBA(1, .9, .4, .85) : ZLLUMA(1, .85)), ZL_Origin::TopLeft);
+			snprintf(buf, sizeof(buf), "Heap %.1f MB (peak %.1f MB)  RSS %.1f MB", ZL_Math::Max(AllocTrack.live.load(), (Bit64s)0) / 1048576.0f, AllocTrack.peak.load() / 1048576.0f, rss / 1048576.0f);
+			fntOSD.Draw(x0, (y -= 30), buf, ZLLUMA(1, .85), ZL_Origin::TopLeft);
+			y -= 30;
+		}
+		if (InputThread.Active())
+		{
+			snprintf(buf, sizeof(buf), "Input age %.2f ms (%u events, %u dropped)", InputThread.ageMs, InputThread.events, InputThread.dropped.load());
+			fntOSD.Draw(x0, y, buf, ZLLUMA(1, .85), ZL_Origin::TopLeft);
+			y -= 30;
+		}
+		if (FrameDelay.enabled)
+		{
+			snprintf(buf, sizeof(buf), "Frame delay %.1f ms%s (work max %.2f ms, %u misses)", FrameDelay.delayMs, (FrameDelay.automatic ? " auto" : ""), FrameDelay.maxWorkMs, FrameDelay.misses);
+			fntOSD.Draw(x0, y, buf, (FrameDelay.misses ? ZLRGBA(1, .9, .4, .85) : ZLLUMA(1, .85)), ZL_Origin::TopLeft);
+			y -= 30;
+		}
+		if (HwCounters.enabled)
+		{
+			snprintf(buf, sizeof(buf), "Process IPC %.2f  cache miss %.2f/ki  branch miss %.2f/ki", HwCounters.ipc, HwCounters.cacheMPKI, HwCounters.branchMPKI);
+			fntOSD.Draw(x0, y, buf, ZLLUMA(1, .85), ZL_Origin::TopLeft);
+			y -= 30;
+		}
+		snprintf(buf, sizeof(buf), "p50 %.2f  p95 %.2f  p99 %.2f ms", p50, p95, p99);
+		fntOSD.Draw(x0, y, buf, ZLLUMA(1, .85), ZL_Origin::TopLeft);
+		snprintf(buf, sizeof(buf), "%u of %u frames over %.2f ms budget", over, count, budget);
+		fntOSD.Draw(x0, (y -= 30), buf, (over ? ZLRGBA(1, .4, .4, .85) : ZLLUMA(1, .85)), ZL_Origin::TopLeft);
+		for (int ph = 0; ph != NUM_PHASES; ph++)
+		{
+			y -= 30;
+			ZL_Display::FillRect(x0, y - 20, x0 + 14, y - 6, cols[ph]);
+			int len = (ph == RUN ? snprintf(buf, sizeof(buf), "%.3f ms (%.1f calls)", avg[ph], (float)avgCalls / count) : snprintf(buf, sizeof(buf), "%.3f ms", avg[ph]));
+			if (allocTrack) snprintf(buf + len, sizeof(buf) - len, "  %.1f allocs", avgAllocs[ph]);
+			fntOSD.Draw(x0 + 24, y, names[ph], ZLLUMA(1, .85), ZL_Origin::TopLeft);
+			fntOSD.Draw(x0 + w, y, buf, ZLLUMA(1, .85), ZL_Origin::TopRight);
 		}
-		case RETRO_ENVIRONMENT_SHUTDOWN:
-			ZL_Application::Quit();
-			return true;
 	}
-	ZL_ASSERTMSG1(false, "[retro_environment_cb] UNSUPPORTED CMD: %d", cmd);
-	return false;
-}
+} Profiler;
 
-static bool AudioMix(short* buffer, unsigned int samples, bool need_mix)
+// Audio output without an audio device for headless and benchmark runs
+// Instead of the device pulling audio through AudioMix, the mixer is drained after every retro_run against a virtual sample clock
+static struct SAudioSink
 {
-	unsigned char tm = (LastAudioThrottleMode == RETRO_THROTTLE_FAST_FORWARD ? RETRO_THROTTLE_FAST_FORWARD : ThrottleMode);
-	LastAudioThrottleMode = ThrottleMode;
+	enum EMode : unsigned char { DEVICE, DISCARD, WAVFILE } mode;
+	double clock; // number of samples due according to emulated time
+	FILE* f;
+	unsigned bytes;
+	std::string path;
 
-	extern Bit32u DBP_MIXER_DoneSamplesCount();
-	size_t have = DBP_MIXER_DoneSamplesCount(), want = samples;
-	if (tm == RETRO_THROTTLE_FAST_FORWARD) want = (FastRate ? (size_t)(samples * FastRate) : (size_t)DBP_MIXER_DoneSamplesCount());
-	if (tm == RETRO_THROTTLE_SLOW_MOTION) want = (size_t)(samples * SlowRate);
-	for (unsigned int tick = 0; have < want;)
+	void Open()
 	{
-		ZL_Thread::Sleep(0);
-		have = DBP_MIXER_DoneSamplesCount();
-		if (have >= want) break;
-		if (!tick) tick = SDL_GetTicks();
-		if (((int)SDL_GetTicks() - (int)tick) >= (AudioLatency)) { /*ZL_LOG("AUDIOMIX", "Not enough audio");*/ break; } // emulation lagging (or crashed)
+		if (mode != WAVFILE || f) return;
+		if (!(f = fopen_wrap(path.c_str(), "wb"))) { mode = DISCARD; return; }
+		setvbuf(f, NULL, _IOFBF, 1 << 16);
+		const unsigned rate = (unsigned)(av.timing.sample_rate + .4999);
+		unsigned char hdr[44];
+		memcpy(hdr, "RIFF\0\0\0\0WAVEfmt ", 16); SCapture::PutLE(hdr + 16, 16, 4); SCapture::PutLE(hdr + 20, 1, 2); SCapture::PutLE(hdr + 22, 2, 2);
+		SCapture::PutLE(hdr + 24, rate, 4); SCapture::PutLE(hdr + 28, rate * 4, 4); SCapture::PutLE(hdr + 32, 4, 2); SCapture::PutLE(hdr + 34, 16, 2); memcpy(hdr + 36, "data\0\0\0\0", 8);
+		fwrite(hdr, 44, 1, f);
+		bytes = 0;
 	}
 
-	if (have == 0)
+	void Drain()
 	{
-		//ZL_LOG("AUDIOMIX", "Have zero audio");
-		memset(buffer, 0, samples * 4);
-		return true;
+		extern Bit32u DBP_MIXER_DoneSamplesCount();
+		if (!av.timing.fps) return;
+		const double frame_samples = av.timing.sample_rate / av.timing.fps;
+		clock += frame_samples;
+		size_t want = (size_t)clock, have = DBP_MIXER_DoneSamplesCount();
+		if (want > have) want = have; // core is behind the clock (i.e. while starting up)
+		clock = ZL_Math::Min(clock - want, frame_samples * 2); // don't let the debt build up over more than two frames
+		if (mode == WAVFILE && !f) Open();
+
+		enum { CHUNK = 4096 };
+		static short buf[CHUNK * 2]; // stereo
+		for (size_t n; want; want -= n)
+		{
+			n = ZL_Math::Min(want, (size_t)CHUNK);
+			MixerCallBack((unsigned char*)buf, n);
+			if (f) { fwrite(buf, n * 4, 1, f); bytes += (unsigned)(n * 4); }
+			if (Capture.active) Capture.PushAudio(buf, (unsigned)n);
+		}
 	}
 
-	const bool catchup = (have > want * (av.timing.fps < 50 ? 20 : 6)/4 && want == samples);
-	static unsigned int catchups;
-	if (catchup || catchups)
+	void Close()
 	{
-		// When running with vsync we need to allow catching up for potentially much longer (until the emulation skips a frame)
-		unsigned int skip_catchups = 30; float corefps = (float)av.timing.fps, vsyncfps = ZL_Application::GetVsyncFps();
-		if (vsyncfps && vsyncfps > corefps) skip_catchups += (unsigned int)(1000.0f / ((vsyncfps - corefps) * AudioLatency));
-		catchups += (catchup ? 2 : -1);
-		//if (catchups > skip_catchups) want = samples * (((have - want) <= 800 ? 40800 : (40000 + have - want))) / 40000; // alternative speed up playback
-		//if (catchups > skip_catchups*2) catchups = 20;
-		if (catchups > skip_catchups || have > want * 3) AudioSkip = true;
-		ZL_LOG("AUDIOMIX", "Catch-up - Have %d but want %d (catchups: %u)", (int)have, (int)want, catchups);
+		if (!f) return;
+		unsigned char sz[4];
+		SCapture::PutLE(sz, bytes + 36, 4); fseek(f, 4, SEEK_SET); fwrite(sz, 4, 1, f);
+		SCapture::PutLE(sz, bytes, 4); fseek(f, 40, SEEK_SET); fwrite(sz, 4, 1, f);
+		fclose(f);
+		f = NULL;
 	}
+} AudioSink;
 
-	void MIXER_CallBack(void *userdata, unsigned char *stream, int len);
-	if (have < want || want != samples || AudioSkip || tm == RETRO_THROTTLE_FRAME_STEPPING)
+// Unthrottled benchmark run started with --benchmark, the results are printed to stdout as JSON on exit
+static void MeasureInputQueries(double& resolveNs, double& snapshotNs);
+
+static struct SBenchmark
+{
+	bool active, started;
+	Bit64u inputQueries; // retro_input_state_cb calls while measuring
+	std::string statePath;
+	std::vector<unsigned> runUsec; // duration of every retro_run call
+	retro_time_t wallStart, wallEnd;
+
+	static size_t GetPeakRSS()
 	{
-		enum { UI_MAX_SAMPLES = 4096*4 };
-		static short stretchbuf[UI_MAX_SAMPLES * 2]; // stereo
+		#if defined(_MSC_VER) || defined(__MINGW32__) || defined(__WIN32__) || defined(WIN32) || defined(_WIN32)
+		PROCESS_MEMORY_COUNTERS pmc;
+		return (GetProcessMemoryInfo(GetCurrentProcess(), &pmc, sizeof(pmc)) ? (size_t)pmc.PeakWorkingSetSize : 0);
+		#else
+		struct rusage ru;
+		if (getrusage(RUSAGE_SELF, &ru)) return 0;
+		#if defined(__APPLE__)
+		return (size_t)ru.ru_maxrss; // bytes
+		#else
+		return (size_t)ru.ru_maxrss * 1024; // kilobytes
+		#endif
+		#endif
+	}
 
-		size_t use;
-		if (tm == RETRO_THROTTLE_FAST_FORWARD || tm == RETRO_THROTTLE_SLOW_MOTION) use = ZL_Math::Min(have, want);
-		else if (have >= want || AudioSkip || tm == RETRO_THROTTLE_FRAME_STEPPING)
+	void AfterFrame()
+	{
+		if (started) { wallEnd = dbp_cpu_features_get_time_usec(); return; }
+
+		// The first frame starts up the emulation, after it a save state can be loaded and measuring begins
+		if (!statePath.empty() && !RunLoad(statePath.c_str())) { fprintf(stderr, "Failed to load state '%s'\n", statePath.c_str()); ZL_Application::Quit(1); return; }
+		runUsec.reserve(RunFrameLimit * 2);
+		RunFrameCount = 0;
+		wallStart = wallEnd = dbp_cpu_features_get_time_usec();
+		started = true;
+	}
+
+	static const char* EffectiveOption(const char* key)
+	{
+		const char* value = NULL;
+		if (!OptionStore.Get(key, value)) { mtxCoreOptions.Lock(); OptionStore.Publish(key); mtxCoreOptions.Unlock(); OptionStore.Get(key, value); }
+		return (value ? value : "");
+	}
+
+	void Report()
+	{
+		if (!started || runUsec.empty()) { printf("{ \"error\": \"no frames were run\" }\n"); return; }
+		std::vector<unsigned> sorted(runUsec);
+		std::sort(sorted.begin(), sorted.end());
+		double sum = 0; for (unsigned u : sorted) sum += u;
+		const size_t n = sorted.size();
+		const double wall = (wallEnd - wallStart) / 1000000.0;
+		#define DBP_BENCH_PCT(p) (sorted[ZL_Math::Min(n * p / 100, n - 1)] / 1000.0)
+
+		// Report the values in effect including --option and cycle governor overrides
+		const char *cycles = EffectiveOption("dosbox_pure_cycles"), *cycles_max = EffectiveOption("dosbox_pure_cycles_max");
+		const char *cycles_scale = EffectiveOption("dosbox_pure_cycles_scale"), *cycle_limit = EffectiveOption("dosbox_pure_cycle_limit");
+
+		printf("{\n");
+		printf("  \"content\": \"%s\",\n", DBPS_GetContentName().c_str());
+		printf("  \"state\": \"%s\",\n", statePath.c_str());
+		printf("  \"frames\": %u,\n", RunFrameCount);
+		printf("  \"retro_run_calls\": %u,\n", (unsigned)n);
+		printf("  \"wall_time_sec\": %.4f,\n", wall);
+		printf("  \"emulated_fps\": %.3f,\n", (wall > 0 ? RunFrameCount / wall : 0.0));
+		printf("  \"core_fps\": %.3f,\n", av.timing.fps);
+		const double mean = sum / n; double var = 0; for (unsigned u : sorted) var += (u - mean) * (u - mean);
+		printf("  \"retro_run_ms\": { \"mean\": %.4f, \"p50\": %.4f, \"p90\": %.4f, \"p95\": %.4f, \"p99\": %.4f, \"max\": %.4f, \"stddev\": %.4f },\n",
+			mean / 1000.0, DBP_BENCH_PCT(50), DBP_BENCH_PCT(90), DBP_BENCH_PCT(95), DBP_BENCH_PCT(99), sorted[n - 1] / 1000.0, sqrt(var / n) / 1000.0);
+		printf("  \"peak_rss_bytes\": %llu,\n", (unsigned long long)GetPeakRSS());
+		double resolveNs, snapshotNs;
+		MeasureInputQueries(resolveNs, snapshotNs);
+		printf("  \"input\": { \"queries_per_frame\": %.2f, \"resolve_ns_per_query\": %.2f, \"snapshot_ns_per_query\": %.2f },\n", (double)inputQueries / n, resolveNs, snapshotNs);
+		if (HwCounters.enabled)
 		{
-			// When lagging behind, don't speed audio up and just scrap it instead (one hiccup is better than prolonged audio speedup)
-			if (AudioSkip) { ZL_LOG("AUDIOMIX", "Audio Skip!"); }
-			AudioSkip = false;
-			catchups = 0;
-			use = ZL_Math::Min(have, (size_t)samples);
+			const Bit64u* t = HwCounters.total;
+			printf("  \"hw_counters\": { \"scope\": \"process\", \"cycles\": %llu, \"instructions\": %llu, \"cache_misses\": %llu, \"branch_misses\": %llu, \"ipc\": %.3f, \"cache_misses_per_kilo_instr\": %.3f, \"branch_misses_per_kilo_instr\": %.3f },\n",
+				(unsigned long long)t[SHwCounters::CYCLES], (unsigned long long)t[SHwCounters::INSTRUCTIONS], (unsigned long long)t[SHwCounters::CACHE_MISSES], (unsigned long long)t[SHwCounters::BRANCH_MISSES],
+				(t[SHwCounters::CYCLES] ? (double)t[SHwCounters::INSTRUCTIONS] / t[SHwCounters::CYCLES] : 0.0),
+				(t[SHwCounters::INSTRUCTIONS] ? t[SHwCounters::CACHE_MISSES] * 1000.0 / t[SHwCounters::INSTRUCTIONS] : 0.0),
+				(t[SHwCounters::INSTRUCTIONS] ? t[SHwCounters::BRANCH_MISSES] * 1000.0 / t[SHwCounters::INSTRUCTIONS] : 0.0));
 		}
-		else use = ((have < 10) ? have : (have * 7 / 10)); // use 70% for stretching while ahead, keep 20% as additional buffer to not fall behind again
+		printf("  \"cycles\": { \"dosbox_pure_cycles\": \"%s\", \"dosbox_pure_cycles_max\": \"%s\", \"dosbox_pure_cycles_scale\": \"%s\", \"dosbox_pure_cycle_limit\": \"%s\" }\n",
+			cycles, cycles_max, cycles_scale, cycle_limit);
+		printf("}\n");
+		fflush(stdout);
+		#undef DBP_BENCH_PCT
+	}
+} Benchmark;
 
-		if (use > UI_MAX_SAMPLES) use = UI_MAX_SAMPLES;
-		const double audio_stretch = (tm == RETRO_THROTTLE_FRAME_STEPPING ? 1.0 : (double)use / samples); // don't stretch during frame stepping
-		ZL_LOG("AUDIOMIX", "Stretch %d (of %d available total) into %d (factor %f)", (int)use, (int)have, (int)samples, (float)audio_stretch);
-		for (size_t scrap, keep = want / 5; have >= samples && have > use + keep; have -= scrap)
+// Sweep over a matrix of core option values, every combination is benchmarked in a separate worker process
+static struct SSweep
+{
+	struct SResult { std::vector<const char*> values; double fps, mean, p50, p99, stddev; unsigned long long rss; bool ok; };
+	bool active;
+	std::string matrix, outPath;
+	unsigned jobs;
+
+	std::vector<std::string> keys;
+	std::vector<std::vector<std::string> > values;
+	std::vector<SResult> results;
+	std::string exe, content;
+	std::atomic<unsigned> next, done;
+	ZL_Mutex mtxPrint;
+
+	static double JsonNumber(const std::string& json, const char* key, const char* object = NULL)
+	{
+		// Search only inside the given object (i.e. "retro_run_ms") if there is one
+		const char *p = json.c_str(), *pEnd = p + json.size();
+		if (object)
 		{
-			scrap = ZL_Math::Min((size_t)(have - use - keep), (size_t)UI_MAX_SAMPLES);
-			MIXER_CallBack(NULL, (unsigned char*)stretchbuf, (int)(scrap* 4));
-			ZL_LOG("AUDIOMIX", "Scrapping %d (of %d available total)", (int)scrap, (int)have);
+			if (!(p = strstr(p, object)) || !(p = strchr(p, '{'))) return 0.0;
+			if (const char* close = strchr(p, '}')) pEnd = close;
 		}
-		MIXER_CallBack(NULL, (unsigned char*)stretchbuf, (int)(use* 4));
+		p = strstr(p, key);
+		return (p && p < pEnd ? atof(p + strlen(key)) : 0.0);
+	}
 
-		if (0)
+	static void Quote(std::string& cmd, const std::string& arg)
+	{
+		cmd += '"';
+		#if defined(_MSC_VER) || defined(__MINGW32__) || defined(__WIN32__) || defined(WIN32) || defined(_WIN32)
+		// Backslashes only need doubling in front of a quote (MSVC runtime argument parsing rules)
+		size_t slashes = 0;
+		for (char c : arg)
 		{
-			for (size_t i = 0; i != samples*2; i++, buffer++) // repeat samples
-			{
-				buffer[0] = stretchbuf[i < (use*2) ? i : (use*2) - (i % (use*2))];
-			}
+			if (c == '\\') { slashes++; cmd += c; continue; }
+			if (c == '"') cmd.append(slashes + 1, '\\');
+			slashes = 0;
+			cmd += c;
 		}
-		else
+		cmd.append(slashes, '\\');
+		#else
+		for (char c : arg) { if (c == '"' || c == '\\' || c == '$' || c == '`') cmd += '\\'; cmd += c; }
+		#endif
+		cmd += '"';
+	}
+
+	void RunJob(size_t idx)
+	{
+		#if defined(_MSC_VER) || defined(__MINGW32__) || defined(__WIN32__) || defined(WIN32) || defined(_WIN32)
+		#define popen _popen
+		#define pclose _pclose
+		#endif
+		SResult& r = results[idx];
+		std::string cmd;
+		Quote(cmd, exe);
+		cmd.append(" --benchmark ");
+		Quote(cmd, content);
+		cmd.append(ZL_String::format(" --frames %u", RunFrameLimit).c_str());
+		for (size_t k = 0, i = idx; k != keys.size(); i /= values[k].size(), k++)
 		{
-			for (size_t i = 0, jMax = use - 1; i != samples; i++, buffer += 2) // linear interpolation
-			{
-				const double src_pos_float = i * audio_stretch;
-				const size_t j0 = (size_t)src_pos_float, j1 = j0 + (size_t)(j0 != jMax);
-				const double frac = src_pos_float - j0;
-				buffer[0] = (short)((1.0 - frac) * stretchbuf[j0 * 2 + 0] + frac * stretchbuf[j1 * 2 + 0]); // stretchbuf[j0 * 2 + 0] // simple nearest
-				buffer[1] = (short)((1.0 - frac) * stretchbuf[j0 * 2 + 1] + frac * stretchbuf[j1 * 2 + 1]); // stretchbuf[j0 * 2 + 1] // simple nearest
-			}
+			r.values.push_back(values[k][i % values[k].size()].c_str());
+			cmd.append(" --option ");
+			Quote(cmd, keys[k] + "=" + r.values.back());
 		}
+		#if defined(_MSC_VER) || defined(__MINGW32__) || defined(__WIN32__) || defined(WIN32) || defined(_WIN32)
+		cmd = "\"" + cmd + "\""; // cmd /c strips the outer quotes when the command starts with one
+		#endif
+		std::string json; char buf[1024];
+		if (FILE* pipe = popen(cmd.c_str(), "r")) { while (fgets(buf, sizeof(buf), pipe)) json.append(buf); pclose(pipe); }
+		#undef popen
+		#undef pclose
+		r.ok = (strstr(json.c_str(), "\"emulated_fps\"") != NULL);
+		r.fps    = JsonNumber(json, "\"emulated_fps\": ");
+		r.mean   = JsonNumber(json, "\"mean\": ", "\"retro_run_ms\"");
+		r.p50    = JsonNumber(json, "\"p50\": ", "\"retro_run_ms\"");
+		r.p99    = JsonNumber(json, "\"p99\": ", "\"retro_run_ms\"");
+		r.stddev = JsonNumber(json, "\"stddev\": ", "\"retro_run_ms\"");
+		r.rss    = (unsigned long long)JsonNumber(json, "\"peak_rss_bytes\": ");
+		mtxPrint.Lock();
+		fprintf(stderr, "[%u/%u]", ++done, (unsigned)results.size());
+		for (size_t k = 0; k != keys.size(); k++) fprintf(stderr, " %s=%s", keys[k].c_str(), r.values[k]);
+		if (r.ok) fprintf(stderr, " -> %.2f fps\n", r.fps); else fprintf(stderr, " -> failed\n");
+		mtxPrint.Unlock();
+	}
 
-		if (tm == RETRO_THROTTLE_FRAME_STEPPING && use < samples) { memset(buffer - (samples - use) * 2, 0, (samples - use) * 4); }
-		ui_last_audio_stretch = (float)audio_stretch;
+	static void Worker(SSweep* self)
+	{
+		// Every worker starts the next combination as soon as its previous one finished
+		for (size_t idx; (idx = self->next.fetch_add(1)) < self->results.size();) self->RunJob(idx);
 	}
-	else
+
+	int Run(const char* exePath, const char* contentPath)
 	{
-		MIXER_CallBack(NULL, (unsigned char*)buffer,  (int)(want * 4));
+		// Matrix format: key=value1|value2|...;key2=...
+		for (const char *p = matrix.c_str(), *pEnd; *p; p = (*pEnd ? pEnd + 1 : pEnd))
+		{
+			if (!(pEnd = strchr(p, ';'))) pEnd = p + strlen(p);
+			const char* eq = (const char*)memchr(p, '=', pEnd - p);
+			if (!eq) continue;
+			keys.push_back(std::string(p, eq - p));
+			values.resize(keys.size());
+			for (const char *v = eq + 1, *vEnd; v < pEnd; v = vEnd + 1)
+			{
+				if (!(vEnd = (const char*)memchr(v, '|', pEnd - v))) vEnd = pEnd;
+				values.back().push_back(std::string(v, vEnd - v));
+			}
+		}
+		if (!contentPath || keys.empty()) { fprintf(stderr, "Usage: --sweep <content> --matrix \"key=value1|value2;key2=...\" [--frames N] [--jobs N] [--out results.csv]\n"); return 1; }
+
+		size_t total = 1;
+		for (const std::vector<std::string>& vals : values) total *= vals.size();
+		results.assign(total, SResult());
+		exe = exePath;
+		content = contentPath;
+		if (!jobs) jobs = ZL_Math::Max(std::thread::hardware_concurrency(), 1u);
+		jobs = (unsigned)ZL_Math::Min((size_t)jobs, total);
+		fprintf(stderr, "Running %u combinations with %u parallel workers...\n", (unsigned)total, jobs);
+
+		next = done = 0;
+		std::vector<std::thread> workers;
+		for (unsigned j = 0; j != jobs; j++) workers.push_back(std::thread(Worker, this));
+		for (std::thread& w : workers) w.join();
+
+		// Rank by throughput, failed runs go last
+		std::sort(results.begin(), results.end(), [](const SResult& a, const SResult& b) { return (a.ok != b.ok ? a.ok : a.fps > b.fps); });
+		if (outPath.empty())
+		{
+			const std::string& content_name = DBPS_GetContentName();
+			std::string name(contentPath);
+			size_t slash = name.find_last_of("/\\");
+			outPath = (std::string(PathSaves) += '/').append("sweep_").append(content_name.empty() ? name.substr(slash == std::string::npos ? 0 : slash + 1) : content_name).append(".csv");
+		}
+		FILE* f = fopen_wrap(outPath.c_str(), "wb");
+		if (!f) { fprintf(stderr, "Failed to write '%s'\n", outPath.c_str()); return 1; }
+		fprintf(f, "rank");
+		for (const std::string& k : keys) fprintf(f, ",%s", k.c_str());
+		fprintf(f, ",emulated_fps,retro_run_mean_ms,retro_run_p50_ms,retro_run_p99_ms,retro_run_stddev_ms,peak_rss_bytes,status\n");
+		for (size_t i = 0; i != total; i++)
+		{
+			const SResult& r = results[i];
+			fprintf(f, "%u", (unsigned)(i + 1));
+			for (const char* v : r.values) fprintf(f, ",%s", v);
+			fprintf(f, ",%.3f,%.4f,%.4f,%.4f,%.4f,%llu,%s\n", r.fps, r.mean, r.p50, r.p99, r.stddev, r.rss, (r.ok ? "ok" : "failed"));
+		}
+		fclose(f);
+		fprintf(stderr, "Results written to %s\n", outPath.c_str());
+		return 0;
 	}
-	return true;
+} Sweep;
+
+static void RunCore()
+{
+	// Time spent uploading the OSD happens inside retro_run but is measured separately
+	if (SlowFrames.active) SlowFrames.BeforeRun();
+	if (InputThread.Active()) InputThread.Drain();
+	const retro_time_t t = dbp_cpu_features_get_time_usec(), osd = Profiler.acc[SFrameProfiler::OSD];
+	if (HwCounters.enabled) HwCounters.Begin();
+	if (InputMovie.started && InputMovie.mode) InputMovie.BeforeRun();
+	AllocTrack.phase = SFrameProfiler::RUN;
+	{ TRACE_SCOPE("retro_run"); retro_run(); }
+	AllocTrack.phase = SFrameProfiler::PRESENT;
+	if (HwCounters.enabled) HwCounters.End(Benchmark.started);
+	const retro_time_t d = dbp_cpu_features_get_time_usec() - t;
+	if (Profiler.active) { Profiler.acc[SFrameProfiler::RUN] += d - (Profiler.acc[SFrameProfiler::OSD] - osd); Profiler.calls++; }
+	if (Benchmark.started) Benchmark.runUsec.push_back((unsigned)d);
+	Governor.frameRunUsec += d;
+	FlightRecorder.runUsec += (Bit32u)d;
+	if (SlowFrames.active) SlowFrames.AfterRun(d);
+	if (InputMovie.started) InputMovie.frame++;
+	if (AudioSink.mode != SAudioSink::DEVICE) AudioSink.Drain();
 }
 
 static void RETRO_CALLCONV retro_video_refresh_cb(const void *data, unsigned width, unsigned height, size_t pitch)
@@ -1012,6 +4289,7 @@ static void RETRO_CALLCONV retro_video_refresh_cb(const void *data, unsigned wid
 	if (scaleX != srfCore.GetScaleW() || scaleY != srfCore.GetScaleH())
 	{
 		srfCore.SetScaleTo((float)width, (float)height);
+		InterfaceSettings.pending |= SInterfaceSettings::SHADER | SInterfaceSettings::GEOMETRY;
 		DoApplyInterfaceOptions = true;
 	}
 }
@@ -1019,20 +4297,18 @@ static void RETRO_CALLCONV retro_video_refresh_cb(const void *data, unsigned wid
 void DBPS_SubmitOSDFrame(const void *data, unsigned width, unsigned height)
 {
 	ZL_ASSERT(width == DBPS_OSD_WIDTH && height == DBPS_OSD_HEIGHT);
+	TRACE_SCOPE("OSD upload");
+	const retro_time_t t = Profiler.Now(SFrameProfiler::OSD);
 	srfOSD.SetScaleTo((float)width, (float)height);
 	srfOSD.SetPixels((const unsigned char*)data, 0, 0, width, height, 4);
+	Profiler.Add(SFrameProfiler::OSD, t);
 	unsigned p0 = ((unsigned int*)data)[0], p1 = ((unsigned int*)data)[width/2], p2 = ((unsigned int*)data)[width-1], osdbg = ((p0 == p1 || p0 == p2) ? p0 : p1);
 	colOSDBG = ZL_Color(s((osdbg>>16)&0xFF)/s(255), s((osdbg>>8)&0xFF)/s(255), s(osdbg&0xFF)/s(255), s((osdbg>>24)&0xFF)/s(255));
 }
 
-static void RETRO_CALLCONV retro_input_poll_cb(void)
-{
-	ZL_ASSERT(MainThreadID == SDL_GetThreadID());
-}
-
-static int16_t RETRO_CALLCONV retro_input_state_cb(unsigned port, unsigned device, unsigned index, unsigned id)
+// Full resolving of an input query, used directly only while capturing a bind and otherwise to fill the snapshot once per poll
+static int16_t ResolveInputState(unsigned port, unsigned device, unsigned index, unsigned id)
 {
-	ZL_ASSERT(MainThreadID == SDL_GetThreadID());
 	if (device == RETRO_DEVICE_KEYBOARD)
 	{
 		return (id < RETROK_LAST ? (int16_t)RETROKDown[id] : 0);
@@ -1078,25 +4354,10 @@ static int16_t RETRO_CALLCONV retro_input_state_cb(unsigned port, unsigned devic
 	{
 		if (device != RETRO_DEVICE_MOUSE) return 0;
 		if (ZL_Input::Held(ZL_BUTTON_RIGHT)) { CaptureJoyBind = NULL; return 1; }
-		static const signed char dirsAxis[] = { -1, 1 }, dirsHat[] = { ZL_HAT_UP, ZL_HAT_RIGHT, ZL_HAT_DOWN, ZL_HAT_LEFT }, dirsBall[] = { -2, -1, 1, 2 }, dirsButton[] = { 0 };
-		static const signed char *dirs[] = { NULL, dirsAxis, dirsHat, dirsBall, dirsButton };
-		static const unsigned char dirsCount[] = { 0, COUNT_OF(dirsAxis), COUNT_OF(dirsHat), COUNT_OF(dirsBall), COUNT_OF(dirsButton) };
-		size_t num = 0, have = CaptureJoyState.size();
-		SJoyBind tst = { NULL }; // zero bytes including padding
-		for (ZL_JoystickData* j : vecJoys)
-		{
-			tst.Joy = j;
-			const unsigned char nums[] = { 0, (unsigned char)j->naxes, (unsigned char)j->nhats, (unsigned char)j->nballs, (unsigned char)j->nbuttons };
-			for (tst.From = SJoyBind::FROM_AXIS; tst.From <= SJoyBind::FROM_BUTTON; tst.From = (SJoyBind::EFrom)(tst.From + 1))
-				for (tst.Num = nums[tst.From]; tst.Num--;)
-					for (int d = dirsCount[tst.From]; d--; num++)
-					{
-						tst.Dir = dirs[tst.From][d];
-						unsigned char v = (unsigned char)tst.GetVal(false), &w = (num >= have ? (CaptureJoyState.push_back(v),CaptureJoyState[num]) : CaptureJoyState[num]);
-						if (v != (w & 1)) { if (w < 2 || v) w += 3; else { SetCaptureJoyBind(tst); return 1; } }
-					}
-		}
-		return 0;
+		SJoyBind bnd;
+		if (!CaptureJoy.Scan(false, bnd)) return 0;
+		SetCaptureJoyBind(bnd);
+		return 1;
 	}
 
 	EBindId bid = GetBindIdFromRetro(device, index, id);
@@ -1114,13 +4375,108 @@ static int16_t RETRO_CALLCONV retro_input_state_cb(unsigned port, unsigned devic
 	}
 }
 
+// Input state resolved once in retro_input_poll_cb so every query of the core during retro_run is a table load
+static struct SInputSnapshot
+{
+	enum { JOYPAD_IDS = 16, MOUSE_IDS = 7, POINTER_IDS = 3 };
+	int16_t joypad[_BIND_PORTS][JOYPAD_IDS]; // kept as int16 instead of a bitmask because buttons bound to axes report analog pressure
+	int16_t analog[_BIND_PORTS][2][2];
+	int16_t mouse[MOUSE_IDS], pointer[POINTER_IDS];
+	float mouseX, mouseY; // relative mouse motion accumulated over frames until the core polls it
+	float aheadX, aheadY; // motion already added by the frame delay which ZillaLib reports again in the next frame
+
+	void AddMouseMotion(float lateX = 0, float lateY = 0)
+	{
+		const ZL_Vector d = ZL_Input::MouseDelta();
+		mouseX += d.x - aheadX + lateX;
+		mouseY -= d.y + aheadY - lateY;
+		aheadX = lateX; aheadY = lateY;
+	}
+
+	void Poll()
+	{
+		for (unsigned port = 0; port != _BIND_PORTS; port++)
+		{
+			for (unsigned id = 0; id != JOYPAD_IDS; id++)
+			{
+				joypad[port][id] = ResolveInputState(port, RETRO_DEVICE_JOYPAD, 0, id);
+				const SJoyBind& bnd = JoyBinds[port][GetBindIdFromRetro(RETRO_DEVICE_JOYPAD, 0, id)];
+				if (!joypad[port][id] && bnd.Joy && InputThread.Latched(bnd)) joypad[port][id] = 0x7fff; // pressed and released again since the last poll
+				if (LatencyTest.joypadPressed && port == 0 && id == RETRO_DEVICE_ID_JOYPAD_B) joypad[port][id] = 0x7fff;
+			}
+			for (unsigned index = 0; index != 2; index++)
+				for (unsigned id = 0; id != 2; id++)
+					analog[port][index][id] = ResolveInputState(port, RETRO_DEVICE_ANALOG, index, id);
+		}
+		for (SInputThread::SLatch& l : InputThread.latches) l.Reset();
+		for (unsigned id = 0; id != MOUSE_IDS; id++) mouse[id] = ResolveInputState(0, RETRO_DEVICE_MOUSE, 0, id);
+		for (unsigned id = 0; id != POINTER_IDS; id++) pointer[id] = ResolveInputState(0, RETRO_DEVICE_POINTER, 0, id);
+
+		// Each bit of motion is reported once, also when retro_run runs multiple times in a frame or after frames where the core didn't run
+		mouse[RETRO_DEVICE_ID_MOUSE_X] = (int16_t)ZL_Math::Clamp(mouseX, -0x7fff, 0x7fff);
+		mouse[RETRO_DEVICE_ID_MOUSE_Y] = (int16_t)ZL_Math::Clamp(mouseY, -0x7fff, 0x7fff);
+		mouseX -= mouse[RETRO_DEVICE_ID_MOUSE_X];
+		mouseY -= mouse[RETRO_DEVICE_ID_MOUSE_Y];
+	}
+
+	int16_t Get(unsigned port, unsigned device, unsigned index, unsigned id) const
+	{
+		switch (device)
+		{
+			case RETRO_DEVICE_KEYBOARD: return (id < RETROK_LAST ? (int16_t)RETROKDown[id] : 0);
+			case RETRO_DEVICE_JOYPAD:   return (port < _BIND_PORTS && id < JOYPAD_IDS ? joypad[port][id] : 0);
+			case RETRO_DEVICE_ANALOG:   return (port < _BIND_PORTS && index < 2 && id < 2 ? analog[port][index][id] : 0);
+			case RETRO_DEVICE_MOUSE:    return (id < MOUSE_IDS ? mouse[id] : 0);
+			case RETRO_DEVICE_POINTER:  return (id < POINTER_IDS ? pointer[id] : 0);
+		}
+		return 0;
+	}
+} InputSnapshot;
+
+static void RETRO_CALLCONV retro_input_poll_cb(void)
+{
+	ZL_ASSERT(MainThreadID == SDL_GetThreadID());
+	if (!CaptureJoyBind && !InputMovie.Playing()) InputSnapshot.Poll(); // capturing a bind resolves every query on its own
+}
+
+static int16_t RETRO_CALLCONV retro_input_state_cb(unsigned port, unsigned device, unsigned index, unsigned id)
+{
+	ZL_ASSERT(MainThreadID == SDL_GetThreadID());
+	const int16_t res = (InputMovie.Playing() ? InputMovie.Get(port, device, index, id) : CaptureJoyBind ? ResolveInputState(port, device, index, id) : InputSnapshot.Get(port, device, index, id));
+	if (SlowFrames.active) SlowFrames.RecordInput(port, device, index, id, res);
+	if (InputMovie.Recording()) InputMovie.RecordInput(port, device, index, id, res);
+	if (Benchmark.started) Benchmark.inputQueries++;
+	return res;
+}
+
+static void MeasureInputQueries(double& resolveNs, double& snapshotNs)
+{
+	// Time the joypad and analog queries of all ports once through full resolving and once through the snapshot
+	enum { REPEATS = 20000, QUERIES = _BIND_PORTS * (SInputSnapshot::JOYPAD_IDS + 4) };
+	volatile int sink = 0;
+	for (int pass = 0; pass != 2; pass++)
+	{
+		const retro_time_t t = dbp_cpu_features_get_time_usec();
+		for (int r = 0; r != REPEATS; r++)
+			for (unsigned port = 0; port != _BIND_PORTS; port++)
+			{
+				for (unsigned id = 0; id != SInputSnapshot::JOYPAD_IDS; id++)
+					sink += (pass ? InputSnapshot.Get(port, RETRO_DEVICE_JOYPAD, 0, id) : ResolveInputState(port, RETRO_DEVICE_JOYPAD, 0, id));
+				for (unsigned index = 0; index != 2; index++)
+					for (unsigned id = 0; id != 2; id++)
+						sink += (pass ? InputSnapshot.Get(port, RETRO_DEVICE_ANALOG, index, id) : ResolveInputState(port, RETRO_DEVICE_ANALOG, index, id));
+			}
+		(pass ? snapshotNs : resolveNs) = (dbp_cpu_features_get_time_usec() - t) * 1000.0 / ((double)REPEATS * QUERIES);
+	}
+}
+
 void DBPS_StartCaptureJoyBind(unsigned port, unsigned device, unsigned index, unsigned id, bool axispos)
 {
 	ZL_ASSERT(port < _BIND_PORTS);
 	EBindId bid = GetBindIdFromRetro(device, index, id, axispos);
 	if (bid == _BIND_ID_COUNT) return;
-	CaptureJoyState.clear();
 	CaptureJoyBind = &JoyBinds[port][bid];
+	CaptureJoy.Start();
 }
 
 bool DBPS_HaveJoy() { return !vecJoys.empty(); }
@@ -1167,14 +4523,18 @@ void DBPS_OnContentLoad(const char* name, const char* dir, size_t dirlen)
 	{
 		ZL_String contentPath(dir, dirlen);
 		Cross::NormalizePath(Cross::MakePathAbsolute(contentPath));
-		if (ZL_Application::SettingsGet("interface_contentpath") != contentPath)
+		if (SettingsWriter.Get("interface_contentpath") != contentPath)
 		{
-			ZL_Application::SettingsSet("interface_contentpath", contentPath);
+			mtxCoreOptions.Lock();
+			SettingsWriter.Set("interface_contentpath", contentPath);
+			OptionStore.Publish("interface_contentpath");
+			mtxCoreOptions.Unlock();
 			DirtySettings();
 		}
 	}
-	SynchronizeSettings(true);
+	SettingsWriter.Flush(false);
 	AudioSkip = true;
+	Governor.OnContentLoad();
 }
 
 static bool OnKeyUseHotKey(ZL_KeyboardEvent& e)
@@ -1202,10 +4562,14 @@ static bool OnKeyUseHotKey(ZL_KeyboardEvent& e)
 	pressedFs[f] = e.is_down;
 	switch (f)
 	{
-		case (HOTKEY_F_QUICKSAVE-1):   if (e.is_down) RunSave(); return true;
-		case (HOTKEY_F_QUICKLOAD-1):   if (e.is_down) RunLoad(); return true;
+		case (HOTKEY_F_QUICKSAVE-1):   if (e.is_down) { retro_time_t t = Profiler.Now(SFrameProfiler::SAVELOAD); RunSave(); Profiler.Add(SFrameProfiler::SAVELOAD, t); } return true;
+		case (HOTKEY_F_QUICKLOAD-1):   if (e.is_down && !InputMovie.Playing()) { retro_time_t t = Profiler.Now(SFrameProfiler::SAVELOAD); if (RunLoad() && InputMovie.Recording()) InputMovie.RecordLoad(); Profiler.Add(SFrameProfiler::SAVELOAD, t); } return true;
+		case (HOTKEY_F_TRACE-1):       if (e.is_down) { if (Trace.active) Trace.Stop(); else { Trace.Start(); PushNotify("Started trace", 1000, RETRO_LOG_INFO); } } return true;
+		case (HOTKEY_F_PROFILER-1):    if (e.is_down) Profiler.NextPage(); return true;
+		case (HOTKEY_F_SCREENSHOT-1):  if (e.is_down) Capture.Start(true); return true;
+		case (HOTKEY_F_CAPTURE-1):     if (e.is_down) { if (Capture.active) Capture.Stop(); else Capture.Start(false); } return true;
 		case (HOTKEY_F_FULLSCREEN-1):  if (e.is_down) ZL_Display::ToggleFullscreen(); return true;
-		case (HOTKEY_F_LOCKMOUSE-1):   if (e.is_down) { PointerLock ^= true; vecNotify.push_back({ ZL_TextBuffer(fntOSD, (PointerLock ? "Locked mouse pointer" : "Unlocked mouse pointer")), 500, RETRO_LOG_INFO, ZLTICKS, 0.0f }); } return true;
+		case (HOTKEY_F_LOCKMOUSE-1):   if (e.is_down) { PointerLock ^= true; PushNotify((PointerLock ? "Locked mouse pointer" : "Unlocked mouse pointer"), 500, RETRO_LOG_INFO); } return true;
 		case (HOTKEY_F_PAUSE-1):
 			if (!e.is_down) return true;
 			if (ThrottleMode == RETRO_THROTTLE_FRAME_STEPPING) ApplyFPSLimit(RETRO_THROTTLE_NONE, true);
@@ -1237,7 +4601,7 @@ static bool OnKeyUseHotKey(ZL_KeyboardEvent& e)
 
 static void OnKeyDown(ZL_KeyboardEvent& e)
 {
-	if (OnKeyUseHotKey(e)) return;
+	if (OnKeyUseHotKey(e) || InputMovie.Playing()) return;
 	unsigned rk = (unsigned)ZLKtoRETROKEY[e.key];
 	if (e.is_repeat || rk == RETROK_UNKNOWN) return;
 	RETROKDown[rk] = true;
@@ -1250,15 +4614,19 @@ static void OnKeyDown(ZL_KeyboardEvent& e)
 		((e.mod & (ZLKMOD_CAPS)) ? RETROKMOD_CAPSLOCK : 0) |
 		((e.mod & (ZLKMOD_RESERVED)) ? RETROKMOD_SCROLLOCK : 0);
 	retro_keyboard_event_cb(true, rk, 0, mod);
+	if (SlowFrames.active) SlowFrames.RecordKey(true, rk, mod);
+	if (InputMovie.Recording()) InputMovie.RecordKey(true, rk, mod);
 }
 
 static void OnKeyUp(ZL_KeyboardEvent& e)
 {
-	if (OnKeyUseHotKey(e)) return;
+	if (OnKeyUseHotKey(e) || InputMovie.Playing()) return;
 	unsigned rk = (unsigned)ZLKtoRETROKEY[e.key];
 	if (rk == RETROK_UNKNOWN || !RETROKDown[rk]) return;
 	RETROKDown[rk] = false;
 	retro_keyboard_event_cb(false, (unsigned)ZLKtoRETROKEY[e.key], 0, 0);
+	if (SlowFrames.active) SlowFrames.RecordKey(false, rk, 0);
+	if (InputMovie.Recording()) InputMovie.RecordKey(false, rk, 0);
 }
 
 static void OnDropFile(const ZL_String& path)
@@ -1273,24 +4641,138 @@ static void OnJoyDeviceChange(bool added, int which)
 
 static void OnResized(ZL_WindowResizeEvent& ev)
 {
-	if (ev.window_fullscreen) ZL_Application::SettingsSet("screen_fullscreen", "true");
+	if (Headless) { DoApplyGeometry = true; return; } // don't store the offscreen window size
+	if (ev.window_fullscreen) SettingsWriter.Set("screen_fullscreen", "true");
 	else 
 	{
-		ZL_Application::SettingsDel("screen_fullscreen");
-		if (ev.window_maximized) ZL_Application::SettingsSet("screen_maximized", "true");
+		SettingsWriter.Del("screen_fullscreen");
+		if (ev.window_maximized) SettingsWriter.Set("screen_maximized", "true");
 		else
 		{
-			ZL_Application::SettingsDel("screen_maximized");
-			ZL_Application::SettingsSet("screen_width", (int)ZLWIDTH);
-			ZL_Application::SettingsSet("screen_height", (int)ZLHEIGHT);
+			SettingsWriter.Del("screen_maximized");
+			SettingsWriter.Set("screen_width", (int)ZLWIDTH);
+			SettingsWriter.Set("screen_height", (int)ZLHEIGHT);
 		}
 	}
-	DirtySettings();
+	DirtySettings(); // coalesced with the other resize events into one write
 	DoApplyGeometry = true;
 }
 
+// Post-processing chain configured with the 'shader_chain' setting, i.e. "pass1.glsl|2|linear,pass2.glsl|0|nearest"
+// Each pass is a fragment shader file in the 'shaders' directory under the system path with an optional scale (relative
+// to its input, 0 for viewport size) and the filter mode used to sample its input. The last pass draws to the screen.
+struct SPostPass { ZL_Shader shdr; ZL_String name; float scale; bool linear; int target, w, h; unsigned queries[2]; bool issued[2]; float gpu_ms; };
+struct SPostTarget { ZL_Surface srf; int w, h; };
+static std::vector<SPostPass> vecPostPasses;
+static std::vector<SPostTarget> vecPostPool; // intermediate render targets, only reallocated when a pass changes size
+static bool PostChainTiming;
+static unsigned PostChainFrame;
+
+static void ClearPostPasses()
+{
+	for (SPostPass& p : vecPostPasses) if (p.queries[0]) GLExt.DeleteQueries(2, p.queries);
+	vecPostPasses.clear();
+}
+
+static void LoadPostChain(const ZL_String& chain)
+{
+	TRACE_SCOPE("LoadPostChain");
+	ClearPostPasses();
+	vecPostPool.clear();
+	if (chain.empty()) return;
+	GLExt.Load();
+	for (const ZL_String& passcfg : chain.split(","))
+	{
+		std::vector<ZL_String> parts = passcfg.split("|");
+		if (parts.empty() || parts[0].empty()) continue;
+		SPostPass p = { ZL_Shader(), parts[0], (parts.size() >= 2 ? (float)atof(parts[1].c_str()) : 1.0f), (parts.size() < 3 || (parts[2].c_str()[0]|0x20) != 'n'), -1, 0, 0, { 0, 0 }, { false, false }, 0.0f };
+
+		std::string src(ZL_SHADER_SOURCE_HEADER(ZL_GLES_PRECISION_LOW));
+		FILE* f = fopen_wrap(((std::string(PathSystem) += '/').append("shaders/") += p.name).c_str(), "rb");
+		if (f) { fseek(f, 0, SEEK_END); size_t hdr = src.size(), sz = (size_t)ftell(f); fseek(f, 0, SEEK_SET); src.resize(hdr + sz); if (!sz || !fread(&src[hdr], sz, 1, f)) src.resize(0); fclose(f); }
+		if (f && !src.empty()) p.shdr = ZL_Shader(src.c_str(), NULL, "TextureSize_x", "TextureSize_y", 4, "InputSize_x", "InputSize_y", "OutputSize_x", "OutputSize_y");
+		if (!p.shdr)
+		{
+			PushNotify(ZL_String("Error loading shader pass ").append(p.name).c_str(), 5000, RETRO_LOG_ERROR);
+			ClearPostPasses();
+			return;
+		}
+		if (GLExt.haveTimer) GLExt.GenQueries(2, p.queries);
+		vecPostPasses.push_back(p);
+	}
+}
+
+static void ApplyPostChainGeometry()
+{
+	// Assign pooled render targets to all passes except the last, reusing existing surfaces with matching size
+	std::vector<SPostTarget> oldPool;
+	oldPool.swap(vecPostPool);
+	float in_w = srfCore.GetWidth() * srfCore.GetScaleW(), in_h = srfCore.GetHeight() * srfCore.GetScaleH(), tex_w = (float)srfCore.GetWidth(), tex_h = (float)srfCore.GetHeight();
+	for (size_t i = 0, iLast = vecPostPasses.size() - 1; i <= iLast; i++)
+	{
+		SPostPass& p = vecPostPasses[i];
+		p.target = -1;
+		if (i == iLast || !p.scale) { p.w = ZL_Math::Max((int)core_rec.Width(), 1); p.h = ZL_Math::Max((int)core_rec.Height(), 1); }
+		else { p.w = ZL_Math::Max((int)(in_w * p.scale + .4999f), 1); p.h = ZL_Math::Max((int)(in_h * p.scale + .4999f), 1); }
+		p.shdr.SetUniform(tex_w, tex_h, in_w, in_h, (float)p.w, (float)p.h);
+		if (i == iLast) break;
+
+		const int prevTarget = (i ? vecPostPasses[i - 1].target : -1); // can't render into our own input
+		for (int j = 0; j != (int)vecPostPool.size(); j++)
+			if (j != prevTarget && vecPostPool[j].w == p.w && vecPostPool[j].h == p.h) { p.target = j; break; }
+		if (p.target == -1)
+		{
+			p.target = (int)vecPostPool.size();
+			SPostTarget t = { ZL_Surface(), p.w, p.h };
+			for (size_t k = 0; k != oldPool.size(); k++)
+				if (oldPool[k].w == p.w && oldPool[k].h == p.h) { t.srf = oldPool[k].srf; oldPool.erase(oldPool.begin() + k); break; }
+			if (!t.srf) t.srf = ZL_Surface(p.w, p.h);
+			vecPostPool.push_back(t);
+		}
+		in_w = tex_w = (float)p.w;
+		in_h = tex_h = (float)p.h;
+	}
+	srfCore.SetTextureFilterMode(vecPostPasses[0].linear, vecPostPasses[0].linear);
+	DrawCoreShader = false;
+}
+
+static void DrawPostChain(const float* VerticesBox, const float* TexCoordBox)
+{
+	const unsigned qidx = (PostChainFrame++ & 1);
+	ZL_Surface* src = &srfCore;
+	for (SPostPass& p : vecPostPasses)
+	{
+		if (src != &srfCore) src->SetTextureFilterMode(p.linear, p.linear);
+		if (GLExt.haveTimer && PostChainTiming)
+		{
+			// Read the result from the previous frame to avoid stalling on the GPU (only from queries that have been issued)
+			unsigned avail = 0; Bit64u ns;
+			if (p.issued[qidx]) GLExt.GetQueryObjectuiv(p.queries[qidx], SGLExt::QUERY_RESULT_AVAILABLE, &avail);
+			if (avail) { GLExt.GetQueryObjectui64v(p.queries[qidx], SGLExt::QUERY_RESULT, &ns); p.gpu_ms = ZL_Math::Lerp(p.gpu_ms, (float)(ns / 1000000.0), 0.1f); }
+			GLExt.BeginQuery(SGLExt::TIME_ELAPSED, p.queries[qidx]);
+			p.issued[qidx] = true;
+		}
+		p.shdr.Activate();
+		if (p.target == -1) src->DrawBox(VerticesBox, TexCoordBox, ZLWHITE);
+		else
+		{
+			SPostTarget& t = vecPostPool[p.target];
+			const float w = (float)t.w, h = (float)t.h, TargetBox[] = { 0,h , w,h , 0,0 , w,0 };
+			t.srf.RenderToBegin();
+			src->DrawBox(TargetBox, TexCoordBox, ZLWHITE);
+			t.srf.RenderToEnd();
+			static const float FullTexCoordBox[] = { 0,1 , 1,1 , 0,0 , 1,0 };
+			TexCoordBox = FullTexCoordBox;
+			src = &t.srf;
+		}
+		p.shdr.Deactivate();
+		if (GLExt.haveTimer && PostChainTiming) GLExt.EndQuery(SGLExt::TIME_ELAPSED);
+	}
+}
+
 static void ApplyGeometry()
 {
+	TRACE_SCOPE("ApplyGeometry");
 	DoApplyGeometry = false;
 	float core_ar = av.geometry.aspect_ratio, win_w = ZLWIDTH, win_h = ZL_Math::Max(ZLHEIGHT, 1.0f), win_ar = win_w / win_h, osd_w = DBPS_OSD_WIDTH, osd_h = DBPS_OSD_HEIGHT, osd_ar = osd_w / osd_h;
 	if (DrawStretched) core_ar = win_ar;
@@ -1313,10 +4795,12 @@ static void ApplyGeometry()
 	const bool coreScaleLinear = (CRTFilter || Scaling == 'B' || ((!Scaling || Scaling == 'D') && (coreScale < 3 && coreScaleFrac > 0.01f && coreScaleFrac < 0.99f)));
 	srfCore.SetTextureFilterMode(coreScaleLinear, coreScaleLinear);
 	DrawCoreShader = (shdrCore && (CRTFilter || !(!Scaling || Scaling == 'D') || coreScaleLinear));
+	if (!vecPostPasses.empty()) ApplyPostChainGeometry();
 }
 
 static void ApplyInterfaceOptions()
 {
+	TRACE_SCOPE("ApplyInterfaceOptions");
 	DoApplyInterfaceOptions = false;
 
 	#define xstr(a) str(a)
@@ -1529,65 +5013,83 @@ static void ApplyInterfaceOptions()
 		}
 	);
 
+	typedef SInterfaceSettings S;
+	const S& is = InterfaceSettings;
 	mtxCoreOptions.Lock();
-	ZL_String hkmstr = ZL_Application::SettingsGet("interface_hotkeymod");
-	int hkm = (hkmstr.empty() ? 1 : atoi(hkmstr.c_str()));
-	HotkeyMod = ((hkm & 1) ? ZLKMOD_CTRL : 0) | ((hkm & 2) ? ZLKMOD_ALT : 0) | ((hkm & 4) ? ZLKMOD_SHIFT : 0) | ((hkm & 8) ? ZLKMOD_META : 0) | ((hkm & 16) ? ZLKMOD_MODE : 0);
-
-	SpeedModHold = ((ZL_Application::SettingsGet("interface_speedtoggle").c_str()[0]|0x20) == 'h');
-	const float newFastRate = (ZL_Application::SettingsHas("interface_fastrate") ? ZL_Math::Max((float)atof(ZL_Application::SettingsGet("interface_fastrate").c_str()), 1.001f) : 5.0f);
-	const float newSlowRate = (ZL_Application::SettingsHas("interface_slowrate") ? ZL_Math::Min((float)atof(ZL_Application::SettingsGet("interface_slowrate").c_str()), 0.999f) : 0.3f);
-	const bool defaultPointerLock = ((ZL_Application::SettingsGet("interface_lockmouse").c_str()[0]|0x20) == 't');
-	DisableSystemALT = ((ZL_Application::SettingsGet("interface_systemhotkeys").c_str()[0]|0x20) == 'f');
-	UseMiddleMouseMenu = ((ZL_Application::SettingsGet("interface_middlemouse").c_str()[0]|0x20) == 't');
-	DrawStretched = !strcmp(ZL_Application::SettingsGet("dosbox_pure_aspect_correction").c_str(), "fill");
-	Scaling = (ZL_Application::SettingsGet("interface_scaling").c_str()[0]&0x5f);
-	CRTFilter = atoi(ZL_Application::SettingsGet("interface_crtfilter").c_str());
-	const int audlatency = (ZL_Application::SettingsHas("interface_audiolatency" ) ? ZL_Math::Max(atoi(ZL_Application::SettingsGet("interface_audiolatency").c_str()), 5) : 25);
-
-	static const char* sLastShaderSrc;
-	const bool useCoreShader = (CRTFilter || !Scaling || Scaling == 'D');
-	const char* shaderSrc = (CRTFilter ? fragment_shader_crt_src : (useCoreShader ? fragment_shader_scaling_src : NULL));
-	if (shaderSrc != sLastShaderSrc) { sLastShaderSrc = shaderSrc; shdrCore = (shaderSrc ? ZL_Shader(shaderSrc, NULL, "TextureSize_x", "TextureSize_y", (CRTFilter ? 8 : 0), "InputSize_x", "InputSize_y", "ShadowMask", "ScanlineThinness", "HorizontalBlur", "MaskValue", "Curvature", "Corner") : ZL_Shader()); }
-
-	int crtscanline  = (ZL_Application::SettingsHas("interface_crtscanline" ) ? atoi(ZL_Application::SettingsGet("interface_crtscanline" ).c_str()) : 1); //{ "0", "No scanline gaps" },{ "4", "Weak gaps" },{ "8", "Strong gaps" },
-	int crtblur      = (ZL_Application::SettingsHas("interface_crtblur"     ) ? atoi(ZL_Application::SettingsGet("interface_crtblur"     ).c_str()) : 2); //{ "0", "Blurry" },{ "1", "Smooth" },{ "2", "Default" },{ "3", "Pixely" },{ "4", "Sharper" },
-	int crtmask      = (ZL_Application::SettingsHas("interface_crtmask"     ) ? atoi(ZL_Application::SettingsGet("interface_crtmask"     ).c_str()) : 2); //{ "0", "Disabled" },{ "1", "Weak" },{ "2", "Default" },{ "3", "Strong" },{ "4", "Very Strong" },
-	int crtcurvature = (ZL_Application::SettingsHas("interface_crtcurvature") ? atoi(ZL_Application::SettingsGet("interface_crtcurvature").c_str()) : 2); //{ "0", "Disabled" },{ "1", "Weak" },{ "2", "Default" },{ "3", "Strong" },{ "4", "Very Strong" },
-	int crtcorner    = (ZL_Application::SettingsHas("interface_crtcorner"   ) ? atoi(ZL_Application::SettingsGet("interface_crtcorner"   ).c_str()) : 2); //{ "0", "Disabled" },{ "1", "Weak" },{ "2", "Default" },{ "3", "Strong" },{ "4", "Very Strong" },
-
+	const unsigned changed = InterfaceSettings.Refresh();
 	mtxCoreOptions.Unlock();
 
-	float ScanlineThinness = 0.5f + (crtscanline * 0.05f);
-	float HorizontalBlur = (crtblur == 0 ? -1.f : crtblur == 1 ? -2.f : crtblur == 2 ? -2.5f : (float)-crtblur);
-	float MaskValue = 1.0f - (0.25f * crtmask);
-	float Curvature = 0.01f * crtcurvature;
-	float Corner = 2.2f * crtcorner;
+	if (changed & S::HOTKEYS)
+	{
+		const int hkm = is.Int(S::HOTKEYMOD);
+		HotkeyMod = ((hkm & 1) ? ZLKMOD_CTRL : 0) | ((hkm & 2) ? ZLKMOD_ALT : 0) | ((hkm & 4) ? ZLKMOD_SHIFT : 0) | ((hkm & 8) ? ZLKMOD_META : 0) | ((hkm & 16) ? ZLKMOD_MODE : 0);
+		SpeedModHold = ((is.Char(S::SPEEDTOGGLE)|0x20) == 'h');
+		DisableSystemALT = !is.Bool(S::SYSTEMHOTKEYS);
+		UseMiddleMouseMenu = is.Bool(S::MIDDLEMOUSE);
+	}
+
+	if (changed & S::SHADER)
+	{
+		Scaling = (is.Char(S::SCALING)&0x5f);
+		CRTFilter = is.Int(S::CRTFILTER);
+		static const char* sLastShaderSrc;
+		const bool useCoreShader = (CRTFilter || !Scaling || Scaling == 'D');
+		const char* shaderSrc = (CRTFilter ? fragment_shader_crt_src : (useCoreShader ? fragment_shader_scaling_src : NULL));
+		if (shaderSrc != sLastShaderSrc) { sLastShaderSrc = shaderSrc; shdrCore = (shaderSrc ? ZL_Shader(shaderSrc, NULL, "TextureSize_x", "TextureSize_y", (CRTFilter ? 8 : 0), "InputSize_x", "InputSize_y", "ShadowMask", "ScanlineThinness", "HorizontalBlur", "MaskValue", "Curvature", "Corner") : ZL_Shader()); }
+
+		const int crtblur = is.Int(S::CRTBLUR); //{ "0", "Blurry" },{ "1", "Smooth" },{ "2", "Default" },{ "3", "Pixely" },{ "4", "Sharper" },
+		float ScanlineThinness = 0.5f + (is.Int(S::CRTSCANLINE) * 0.05f); //{ "0", "No scanline gaps" },{ "4", "Weak gaps" },{ "8", "Strong gaps" },
+		float HorizontalBlur = (crtblur == 0 ? -1.f : crtblur == 1 ? -2.f : crtblur == 2 ? -2.5f : (float)-crtblur);
+		float MaskValue = 1.0f - (0.25f * is.Int(S::CRTMASK)); //{ "0", "Disabled" },{ "1", "Weak" },{ "2", "Default" },{ "3", "Strong" },{ "4", "Very Strong" },
+		float Curvature = 0.01f * is.Int(S::CRTCURVATURE); // same choices as mask
+		float Corner = 2.2f * is.Int(S::CRTCORNER); // same choices as mask
+
+		if (useCoreShader)
+			shdrCore.SetUniform(s(srfCore.GetWidth()), s(srfCore.GetHeight()), s(srfCore.GetWidth()*srfCore.GetScaleW()), s(srfCore.GetHeight()*srfCore.GetScaleH()), s(CRTFilter), s(ScanlineThinness), s(HorizontalBlur), s(MaskValue), s(Curvature), s(Corner));
+	}
+
+	if (changed & S::POSTCHAIN)
+	{
+		const bool timing = is.Bool(S::SHADERCHAINTIMING);
+		if (timing && !PostChainTiming) for (SPostPass& p : vecPostPasses) { p.gpu_ms = 0; p.issued[0] = p.issued[1] = false; } // don't show times from before
+		PostChainTiming = timing;
+		static ZL_String sLastShaderChain;
+		if (is.Text(S::SHADERCHAIN) != sLastShaderChain) { sLastShaderChain = is.Text(S::SHADERCHAIN); LoadPostChain(sLastShaderChain); }
+	}
 
-	if (useCoreShader)
-		shdrCore.SetUniform(s(srfCore.GetWidth()), s(srfCore.GetHeight()), s(srfCore.GetWidth()*srfCore.GetScaleW()), s(srfCore.GetHeight()*srfCore.GetScaleH()), s(CRTFilter), s(ScanlineThinness), s(HorizontalBlur), s(MaskValue), s(Curvature), s(Corner));
+	if (changed & S::TOOLS)
+	{
+		Governor.Enable(is.Bool(S::CYCLEGOVERNOR) && !Benchmark.active);
+		SlowFrames.Enable(is.Float(S::SLOWFRAMECAPTURE), (unsigned)is.Int(S::SLOWFRAMEHISTORY));
+		if (is.Bool(S::INPUTTHREAD)) InputThread.Start(); else InputThread.Stop();
+		FrameDelay.Enable((is.Auto(S::FRAMEDELAY) || is.Float(S::FRAMEDELAY) > 0), is.Auto(S::FRAMEDELAY), is.Float(S::FRAMEDELAY));
+	}
 
-	if (newFastRate != FastRate || newSlowRate != SlowRate)
+	if ((changed & S::SPEED) && (is.Float(S::FASTRATE) != FastRate || is.Float(S::SLOWRATE) != SlowRate))
 	{
-		FastRate = newFastRate;
-		SlowRate = newSlowRate;
+		FastRate = is.Float(S::FASTRATE);
+		SlowRate = is.Float(S::SLOWRATE);
 		if (ThrottleMode) ApplyFPSLimit(); // apply change
 	}
 
-	if (audlatency != AudioLatency)
+	if ((changed & S::AUDIO) && is.Int(S::AUDIOLATENCY) != AudioLatency)
 	{
 		AudioSkip = true;
-		AudioLatency = audlatency;
-		ZL_Audio::Init(audlatency * 44100 / 1000);
+		AudioLatency = is.Int(S::AUDIOLATENCY);
+		if (AudioSink.mode == SAudioSink::DEVICE) ZL_Audio::Init(AudioLatency * 44100 / 1000);
 	}
 
-	if (defaultPointerLock != DefaultPointerLock)
+	if ((changed & S::POINTER) && is.Bool(S::LOCKMOUSE) != DefaultPointerLock)
 	{
-		if (DefaultPointerLock == PointerLock) { PointerLock ^= true; vecNotify.push_back({ ZL_TextBuffer(fntOSD, (PointerLock ? "Locked mouse pointer" : "Unlocked mouse pointer")), 500, RETRO_LOG_INFO, ZLTICKS, 0.0f }); }
-		DefaultPointerLock = defaultPointerLock;
+		if (DefaultPointerLock == PointerLock) { PointerLock ^= true; PushNotify((PointerLock ? "Locked mouse pointer" : "Unlocked mouse pointer"), 500, RETRO_LOG_INFO); }
+		DefaultPointerLock = is.Bool(S::LOCKMOUSE);
 	}
 
-	ApplyGeometry(); // apply int scaling, shader use, texture scaling mode
+	if (changed & S::GEOMETRY)
+	{
+		DrawStretched = (is.Text(S::ASPECTCORRECTION) == "fill");
+		ApplyGeometry(); // apply int scaling, shader use, texture scaling mode
+	}
 }
 
 static bool DrawIntro()
@@ -1635,13 +5137,17 @@ static bool DrawIntro()
 
 static void OnDraw()
 {
-	SynchronizeSettings(false);
+	static bool tracePresent; // buffer swap and frame limiter wait happen between two calls of OnDraw
+	if (tracePresent) { Trace.Event("Present", 'E'); tracePresent = false; }
+	Profiler.BeginFrame();
+	if (LatencyTest.active) LatencyTest.BeginFrame();
 
 	if (UseMiddleMouseMenu && ZL_Input::Down(ZL_BUTTON_MIDDLE)) DBPS_ToggleOSD();
 
 	bool showOSD = DBPS_IsShowingOSD();
 	static bool doPointerLock, doHideCursor, lastHiddenCursor;
-	if (PointerLock && !showOSD)
+	if (Headless) {}
+	else if (PointerLock && !showOSD)
 	{
 		if (!doPointerLock) { ZL_Display::SetPointerLock((doPointerLock = true)); PointerLockPos = ZL_Input::Pointer(); }
 		PointerLockPos = (showOSD ? osd_rec : core_rec).Clamp(PointerLockPos + ZL_Input::MouseDelta());
@@ -1657,22 +5163,48 @@ static void OnDraw()
 		}
 	}
 
+	if (FrameDelay.enabled)
+	{
+		const retro_time_t tWait = Profiler.Now(SFrameProfiler::PRESENT);
+		FrameDelay.Wait();
+		Profiler.Add(SFrameProfiler::PRESENT, tWait);
+	}
+
 	if (!ThrottlePaused)
 	{
-		retro_run();
+		InputSnapshot.AddMouseMotion(FrameDelay.lateX, FrameDelay.lateY);
+		RunCore();
+		if (RunFrameLimit && ++RunFrameCount == RunFrameLimit) ZL_Application::Quit();
+		if (Benchmark.active) Benchmark.AfterFrame();
+		if (InputMovie.mode && !InputMovie.started) InputMovie.Start();
 		if (ThrottleMode == RETRO_THROTTLE_FRAME_STEPPING) ThrottlePaused = true;
 		if (ThrottleMode == RETRO_THROTTLE_FAST_FORWARD && (av.timing.fps * FastRate) >= FAST_FPS_LIMIT)
 			for (int repeats = (int)FastRate; --repeats;)
-				retro_run();
+				RunCore();
 		if (ThrottleMode == RETRO_THROTTLE_FAST_FORWARD && !FastRate)
 			for (retro_time_t rt = dbp_cpu_features_get_time_usec(), rtMax = rt + ((retro_time_t)1200000 / (retro_time_t)av.timing.fps); rt < rtMax; rt = dbp_cpu_features_get_time_usec())
-				retro_run();
+				RunCore();
+		if (Governor.enabled) Governor.Frame();
 	}
+	else InputSnapshot.aheadX = InputSnapshot.aheadY = 0; // the motion counted ahead is dropped with the motion of the paused frame
 
+	if (Capture.active || Capture.wantShot || Capture.pboTail != Capture.pboHead) Capture.Readback();
+	if (LatencyTest.active) LatencyTest.Readback();
+	FlightRecorder.Frame(dbp_cpu_features_get_time_usec(), DoSave, DoLoad, ThrottlePaused);
+	retro_time_t t = Profiler.Now(SFrameProfiler::SAVELOAD);
 	if (DoSave) RunSave();
-	if (DoLoad) RunLoad();
+	if (DoLoad && RunLoad() && InputMovie.Recording()) InputMovie.RecordLoad();
+	Profiler.Add(SFrameProfiler::SAVELOAD, t);
+	t = Profiler.Now(SFrameProfiler::OPTIONS);
+	if (ThreadEvents.Pending() || ThreadEvents.dropped.load(std::memory_order_relaxed)) DrainThreadEvents();
 	if (DoApplyInterfaceOptions) ApplyInterfaceOptions();
 	if (DoApplyGeometry) ApplyGeometry();
+	Profiler.Add(SFrameProfiler::OPTIONS, t);
+
+	t = Profiler.Now(SFrameProfiler::DRAW);
+	if (Headless) { FrameDelay.EndWork(); Profiler.EndFrame(t); return; } // skip presentation
+	const bool traceDraw = Trace.active.load(std::memory_order_relaxed);
+	if (traceDraw) Trace.Event("Draw", 'B');
 
 	extern void ZL_GL_ResetFrameBuffer();
 	ZL_GL_ResetFrameBuffer();
@@ -1683,9 +5215,13 @@ static void OnDraw()
 	{
 		const float VerticesBox[] = { core_rec.left,core_rec.high , core_rec.right,core_rec.high , core_rec.left,core_rec.low , core_rec.right,core_rec.low };
 		const float u = srfCore.GetScaleW(), v = srfCore.GetScaleH(), TexCoordBox[] = { 0,v , u,v , 0,0 , u,0 };
-		if (DrawCoreShader) shdrCore.Activate();
-		srfCore.DrawBox(VerticesBox, TexCoordBox, ZLWHITE);
-		if (DrawCoreShader) shdrCore.Deactivate();
+		if (!vecPostPasses.empty()) DrawPostChain(VerticesBox, TexCoordBox);
+		else
+		{
+			if (DrawCoreShader) shdrCore.Activate();
+			srfCore.DrawBox(VerticesBox, TexCoordBox, ZLWHITE);
+			if (DrawCoreShader) shdrCore.Deactivate();
+		}
 	}
 
 	static float osdf;
@@ -1720,6 +5256,15 @@ static void OnDraw()
 		if (ThrottleMode == RETRO_THROTTLE_FRAME_STEPPING) ZL_Display::FillRect(    x+30,y+5 , x+40,y+45 , colfg);
 	}
 
+	if (Capture.active)
+	{
+		float x = (ThrottleMode != RETRO_THROTTLE_NONE ? 70.f : 10.f), y = ZLFROMH(60);
+		ZL_Display::FillRect(x, y, x+50, y+50, ZLLUMA(.2, .5));
+		ZL_Display::FillCircle(x+25, y+25, 15, ZLRGBA(1, .1, .1, ((ZLTICKS / 500) & 1) ? .5 : .9));
+		char buf[32];
+		if (Capture.dropped) { snprintf(buf, sizeof(buf), "%u dropped", Capture.dropped); fntOSD.Draw(x+60, y+25, buf, ZLLUMA(.8, .75), ZL_Origin::CenterLeft); }
+	}
+
 	if (txtOSD.GetWidth(1) && ZLSINCE(txtOSDTick) < 1500)
 	{
 		float x = ZLFROMW(8), y = ZLFROMH(25);
@@ -1732,7 +5277,7 @@ static void OnDraw()
 		SNotify& n = vecNotify[i];
 		if (!n.ticks) n.ticks = ZLTICKS; // fix notifications fired during startup
 		int since = ZLSINCE(n.ticks), duration = (int)n.duration;
-		if (since >= duration + 500) { vecNotify.erase(vecNotify.begin() + i); continue; }
+		if (since >= duration + 500) { if (vecNotifySpare.size() < vecNotifySpare.capacity()) vecNotifySpare.push_back(n.txt); vecNotify.erase(vecNotify.begin() + i); continue; }
 
 		if (!n.y)
 		{
@@ -1754,6 +5299,23 @@ static void OnDraw()
 		n.txt.Draw(x + 10 + 0, y + 17 + 0, col);
 	}
 
+	if (PostChainTiming && GLExt.haveTimer && !vecPostPasses.empty())
+	{
+		float y = ZLFROMH(10), total = 0;
+		char buf[32];
+		ZL_Display::FillRect(10, y, 360, y - 30 * (vecPostPasses.size() + 1) - 10, ZLLUMA(0, .5));
+		for (const SPostPass& p : vecPostPasses)
+		{
+			fntOSD.Draw(20, (y -= 30), p.name, ZLLUMA(1, .75), ZL_Origin::TopLeft);
+			snprintf(buf, sizeof(buf), "%.3f ms", p.gpu_ms);
+			fntOSD.Draw(350, y, buf, ZLLUMA(1, .75), ZL_Origin::TopRight);
+			total += p.gpu_ms;
+		}
+		fntOSD.Draw(20, (y -= 30), "Total GPU", ZLLUMA(1, .75), ZL_Origin::TopLeft);
+		snprintf(buf, sizeof(buf), "%.3f ms", total);
+		fntOSD.Draw(350, y, buf, ZLLUMA(1, .75), ZL_Origin::TopRight);
+	}
+
 	#if defined(ZILLALOG)
 	extern Bit32u DBP_MIXER_DoneSamplesCount();
 	const float dbgy = ZLFROMH(30);
@@ -1767,8 +5329,59 @@ static void OnDraw()
 	if (ui_last_audio_stretch) ui_last_audio_stretch = ZL_Math::Lerp(ui_last_audio_stretch, 1.0f, 0.1f);
 	#endif
 
+	if (Profiler.page == 1) Profiler.Draw();
+	if (Profiler.page == 2) PerfCounters.Draw();
+
 	static bool introdone;
 	if (!introdone) introdone = DrawIntro();
+	FrameDelay.EndWork();
+	Profiler.EndFrame(t);
+	if (traceDraw) Trace.Event("Draw", 'E');
+	if (Trace.active.load(std::memory_order_relaxed)) { Trace.Event("Present", 'B'); tracePresent = true; }
+}
+
+static int ParseCommandLine(int argc, char *argv[])
+{
+	// Remove the options we handle here, leaving the content path and additional discs for OnLoad
+	int res = (argc ? 1 : 0);
+	for (int i = res; i < argc; i++)
+	{
+		const char* arg = argv[i];
+		if      (!strcmp(arg, "--headless")) { Headless = Unthrottled = true; if (AudioSink.mode == SAudioSink::DEVICE) AudioSink.mode = SAudioSink::DISCARD; continue; }
+		else if (!strcmp(arg, "--no-audio")) { AudioSink.mode = SAudioSink::DISCARD; continue; }
+		else if (!strcmp(arg, "--audio-file") && i + 1 < argc) { AudioSink.mode = SAudioSink::WAVFILE; AudioSink.path = argv[++i]; continue; }
+		else if (!strcmp(arg, "--trace")) { Trace.Start(); continue; }
+		else if (!strcmp(arg, "--alloctrack")) { AllocTrack.Enable(); continue; }
+		else if (!strcmp(arg, "--hwcounters") || !strcmp(arg, "--hwsample")) { if (!HwCounters.enabled) HwCounters.Open(arg[4] == 's'); continue; }
+		else if (!strcmp(arg, "--benchmark")) { Benchmark.active = Headless = Unthrottled = ReadOnlySettings = true; AudioSink.mode = SAudioSink::DISCARD; continue; }
+		else if (!strcmp(arg, "--sweep")) { Sweep.active = true; continue; }
+		else if (!strcmp(arg, "--matrix") && i + 1 < argc) { Sweep.matrix = argv[++i]; continue; }
+		else if (!strcmp(arg, "--jobs") && i + 1 < argc) { Sweep.jobs = (unsigned)atoi(argv[++i]); continue; }
+		else if (!strcmp(arg, "--out") && i + 1 < argc) { Sweep.outPath = argv[++i]; continue; }
+		else if (!strcmp(arg, "--option") && i + 1 < argc && strchr(argv[i + 1], '='))
+		{
+			const char *kv = argv[++i], *eq = strchr(kv, '=');
+			OptionStore.SetOverride(std::string(kv, eq - kv).c_str(), eq + 1, true);
+			continue;
+		}
+		else if (!strcmp(arg, "--state") && i + 1 < argc) { Benchmark.statePath = argv[++i]; continue; }
+		else if (!strcmp(arg, "--record-movie") && i + 1 < argc) { InputMovie.mode = SInputMovie::RECORD; InputMovie.path = argv[++i]; continue; }
+		else if (!strcmp(arg, "--play-movie") && i + 1 < argc) { InputMovie.mode = SInputMovie::PLAY; InputMovie.path = argv[++i]; continue; }
+		else if (!strcmp(arg, "--throttle")) { Unthrottled = false; continue; }
+		else if (!strcmp(arg, "--frames") && i + 1 < argc) { RunFrameLimit = (unsigned)atoi(argv[++i]); continue; }
+		else if (!strcmp(arg, "--latency-test") && i + 1 < argc) { LatencyTest.Start((unsigned)atoi(argv[++i])); continue; }
+		else if (!strcmp(arg, "--latency-input") && i + 1 < argc) { LatencyTest.useJoypad = ((argv[++i][0]|0x20) == 'j'); continue; }
+		else if (!strcmp(arg, "--latency-region") && i + 1 < argc) { sscanf(argv[++i], "%d,%d,%d,%d", &LatencyTest.rx, &LatencyTest.ry, &LatencyTest.rw, &LatencyTest.rh); continue; }
+		argv[res++] = argv[i];
+	}
+	if ((Benchmark.active || Sweep.active) && !RunFrameLimit && InputMovie.mode != SInputMovie::PLAY) RunFrameLimit = 3600; // a played movie ends the run
+	if (Headless)
+	{
+		// Render into an offscreen GL context (EGL pbuffer/surfaceless, i.e. Mesa llvmpipe without a display server)
+		// The core still renders into its framebuffer object which is available through retro_hw_get_current_framebuffer
+		if (!getenv("SDL_VIDEODRIVER")) putenv((char*)"SDL_VIDEODRIVER=offscreen");
+	}
+	return res;
 }
 
 static void OnLoad(int argc, char *argv[])
@@ -1801,7 +5414,7 @@ static void OnLoad(int argc, char *argv[])
 	for (int i = 0; i != 4; i++)
 		retro_set_controller_port_device(i, RETRO_DEVICE_JOYPAD);
 
-	ZL_Application::SetFpsLimit((float)av.timing.fps);
+	ZL_Application::SetFpsLimit(Unthrottled ? 0.0f : (float)av.timing.fps);
 	srfCore = ZL_Surface(av.geometry.max_width, av.geometry.max_height);
 	srfOSD = ZL_Surface(DBPS_OSD_WIDTH, DBPS_OSD_HEIGHT, true);
 	shdrOSD = ZL_Shader(ZL_SHADER_SOURCE_HEADER(ZL_GLES_PRECISION_LOW) "uniform sampler2D u_texture; varying vec4 v_color; varying vec2 v_texcoord; void main() { gl_FragColor = v_color * texture2D(u_texture, v_texcoord).bgra; }");
@@ -1880,13 +5493,20 @@ static struct sDOSBoxPure : public ZL_Application
 			useCustomPathSystem &= !invalidPathSystem;
 		}
 
+		SSettingsWriter::Recover(std::string(basePath.c_str()).append(".cfg"));
 		ZL_Application::SettingsInit(basePath.c_str());
+		argc = ParseCommandLine(argc, argv);
+		if (!ReadOnlySettings) SettingsWriter.Start(std::string(basePath.c_str()).append(".cfg"));
+		if (Sweep.active) exit(Sweep.Run(argv[0], (argc > 1 ? argv[1] : NULL)));
+		FlightRecorder.Install();
+		Log.Start();
 		bool screen_fullscreen = (((*ZL_Application::SettingsGet("screen_fullscreen").c_str())|0x20) == 't'); // 't'rue
 		bool screen_maximized = (((*ZL_Application::SettingsGet("screen_maximized").c_str())|0x20) == 't'); // 't'rue
 		int screen_width = atoi(ZL_Application::SettingsGet("screen_width").c_str());
 		int screen_height = atoi(ZL_Application::SettingsGet("screen_height").c_str());
 
-		if (!ZL_Display::Init("DOSBox Pure", (screen_width < 80 ? 1280 : screen_width), (screen_height < 60 ? 720 : screen_height), ZL_DISPLAY_RESIZABLE | ZL_DISPLAY_MINIMIZEDAUDIO | ZL_DISPLAY_PREVENTALTENTER | ZL_DISPLAY_PREVENTALTF4 | (screen_fullscreen ? ZL_DISPLAY_FULLSCREEN : 0) | (screen_maximized ? ZL_DISPLAY_MAXIMIZED : 0))) return;
+		if (Headless) { if (!ZL_Display::Init("DOSBox Pure", 640, 480, 0)) return; }
+		else if (!ZL_Display::Init("DOSBox Pure", (screen_width < 80 ? 1280 : screen_width), (screen_height < 60 ? 720 : screen_height), ZL_DISPLAY_RESIZABLE | ZL_DISPLAY_MINIMIZEDAUDIO | ZL_DISPLAY_PREVENTALTENTER | ZL_DISPLAY_PREVENTALTF4 | (screen_fullscreen ? ZL_DISPLAY_FULLSCREEN : 0) | (screen_maximized ? ZL_DISPLAY_MAXIMIZED : 0))) return;
 		ZL_Display::ClearFill(ZL_Color::White);
 		ZL_Display::SetAA(true);
 		ZL_Input::Init();
@@ -1906,8 +5526,11 @@ static struct sDOSBoxPure : public ZL_Application
 
 		DefaultPointerLock = PointerLock = ((ZL_Application::SettingsGet("interface_lockmouse").c_str()[0]|0x20) == 't');
 		AudioLatency = (ZL_Application::SettingsHas("interface_audiolatency") ? ZL_Math::Max(atoi(ZL_Application::SettingsGet("interface_audiolatency").c_str()), 5) : 25);
-		ZL_Audio::Init(AudioLatency * 44100 / 1000);
-		ZL_Audio::HookAudioMix(AudioMix);
+		if (AudioSink.mode == SAudioSink::DEVICE)
+		{
+			ZL_Audio::Init(AudioLatency * 44100 / 1000);
+			ZL_Audio::HookAudioMix(AudioMix);
+		}
 	}
 
 	virtual void AfterFrame()
@@ -1917,8 +5540,19 @@ static struct sDOSBoxPure : public ZL_Application
 
 	virtual void OnQuit()
 	{
-		SynchronizeSettings(true);
+		if (Benchmark.active) Benchmark.Report();
+		HwCounters.ReportHotspots();
+		FlightRecorder.Dump("exit");
+		InputMovie.Stop();
+		InputThread.Stop();
+		Trace.Stop();
+		Capture.Shutdown();
+		AudioSink.Close();
+		PerfCounters.Dump(PerfCounters.logged);
+		SettingsWriter.Stop();
+		SettingsWriter.Flush(true);
 		retro_unload_game();
+		Log.Stop();
 	}
 
 } DOSBoxPure;